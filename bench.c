@@ -0,0 +1,419 @@
+/* Keystroke-to-paint latency harness.
+
+   bench CTEXT FIXTURE [TRACE]
+
+   Runs CTEXT on a pseudo-terminal against a copy of FIXTURE, replays a
+   keystroke trace and parses the output stream. Every keystroke makes
+   ctext paint one frame, which ends when the cursor is shown again, so the
+   latency of a keystroke is the time from writing it to reading the end of
+   its frame. */
+
+/* Includes */
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Defines */
+#define BENCH_ROWS 24
+#define BENCH_COLS 80
+#define BENCH_TIMEOUT_MS 5000
+#define FRAME_END "\x1b[?25h"
+#define FRAME_END_LEN 6
+
+/* The trace format, one command per line:
+     trace NAME       results below are reported under NAME
+     key BYTES        one keystroke, e.g. an escape sequence
+     repeat N BYTES   N separate keystrokes
+     type TEXT        every byte of TEXT is a keystroke
+     paste TEXT       TEXT written at once, timed until its last frame
+     wait MS          let asynchronous frames (e.g. a save) arrive
+   BYTES and TEXT understand \e \r \n \t \\ and \xHH. */
+const char *default_trace =
+  "trace open-scroll\n"
+  "repeat 200 \\e[B\n"
+  "repeat 10 \\e[6~\n"
+  "repeat 10 \\e[5~\n"
+  "repeat 100 \\e[A\n"
+  "trace typing\n"
+  "repeat 40 \\e[B\n"
+  "type int counter = 42; /* typed */\\r\n"
+  "type while (counter--) { total += counter * 3; }\\r\n"
+  "type char *name = \"ctext latency\";\\r\n"
+  "trace paste\n"
+  "paste struct point { int x, y; };\\rint norm(struct point p) { return p.x * p.x + p.y * p.y; }\\r\n"
+  "trace search\n"
+  "key \\x06\n"
+  "type editor\n"
+  "repeat 20 \\e[B\n"
+  "key \\r\n"
+  "trace save\n"
+  "key \\x13\n"
+  "wait 500\n";
+
+/* Data */
+
+struct benchStats
+{
+  char name[64];
+  double *lat;
+  int nlat;
+  int caplat;
+  long long bytes;
+  long long frames;
+};
+
+struct benchState
+{
+  int fd;
+  pid_t pid;
+  char tail[FRAME_END_LEN];
+  int taillen;
+  struct benchStats *stats;
+  int nstats;
+};
+
+struct benchState B;
+
+/* Utilities */
+
+void die(const char *s)
+{
+  perror(s);
+  if (B.pid > 0)
+    kill(B.pid, SIGKILL);
+  exit(1);
+}
+
+double nowMs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* decodes a trace argument into at most cap bytes, a longer one ends the
+   run */
+int unescape(const char *s, char *out, int cap)
+{
+  int n = 0;
+  while (*s)
+  {
+    if (n == cap)
+    {
+      fprintf(stderr, "bench: trace line longer than %d bytes\n", cap);
+      exit(1);
+    }
+    if (*s != '\\' || !s[1])
+    {
+      out[n++] = *s++;
+      continue;
+    }
+    s++;
+    switch (*s)
+    {
+    case 'e': out[n++] = '\x1b'; s++; break;
+    case 'r': out[n++] = '\r'; s++; break;
+    case 'n': out[n++] = '\n'; s++; break;
+    case 't': out[n++] = '\t'; s++; break;
+    case 'x':
+    {
+      char hex[3] = {0};
+      strncpy(hex, s + 1, 2);
+      out[n++] = (char)strtol(hex, NULL, 16);
+      s += 1 + strlen(hex);
+      break;
+    }
+    default: out[n++] = *s++; break;
+    }
+  }
+  return n;
+}
+
+/* pty */
+
+void benchSpawn(const char *ctext, const char *file)
+{
+  B.fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (B.fd == -1 || grantpt(B.fd) == -1 || unlockpt(B.fd) == -1)
+    die("posix_openpt");
+  struct winsize ws = {BENCH_ROWS, BENCH_COLS, 0, 0};
+  if (ioctl(B.fd, TIOCSWINSZ, &ws) == -1)
+    die("ioctl");
+  char *slave = ptsname(B.fd);
+
+  B.pid = fork();
+  if (B.pid == -1)
+    die("fork");
+  if (B.pid == 0)
+  {
+    setsid();
+    int sfd = open(slave, O_RDWR);
+    if (sfd == -1)
+      _exit(127);
+    dup2(sfd, STDIN_FILENO);
+    dup2(sfd, STDOUT_FILENO);
+    dup2(sfd, STDERR_FILENO);
+    close(sfd);
+    close(B.fd);
+    execl(ctext, ctext, file, (char *)NULL);
+    _exit(127);
+  }
+}
+
+/* reads output until count more frames have ended, returns the bytes read */
+long long benchAwaitFrames(int count)
+{
+  long long bytes = 0;
+  double deadline = nowMs() + BENCH_TIMEOUT_MS;
+  char buf[1 << 16];
+  while (count > 0)
+  {
+    int left = (int)(deadline - nowMs());
+    struct pollfd pfd = {B.fd, POLLIN, 0};
+    if (left <= 0 || poll(&pfd, 1, left) <= 0)
+    {
+      fprintf(stderr, "bench: no frame from ctext within %d ms\n", BENCH_TIMEOUT_MS);
+      die("poll");
+    }
+    ssize_t n = read(B.fd, buf, sizeof(buf));
+    if (n <= 0)
+      die("read");
+    bytes += n;
+
+    /* frame ends can straddle reads, so search across the saved tail */
+    char scan[FRAME_END_LEN + sizeof(buf)];
+    memcpy(scan, B.tail, B.taillen);
+    memcpy(scan + B.taillen, buf, n);
+    int len = B.taillen + n;
+    char *p = scan;
+    while (count > 0 && (p = memmem(p, len - (p - scan), FRAME_END, FRAME_END_LEN)))
+    {
+      p += FRAME_END_LEN;
+      count--;
+    }
+    B.taillen = len < FRAME_END_LEN - 1 ? len : FRAME_END_LEN - 1;
+    memcpy(B.tail, scan + len - B.taillen, B.taillen);
+  }
+  return bytes;
+}
+
+void benchDrain(int ms)
+{
+  char buf[1 << 16];
+  double end = nowMs() + ms;
+  int left;
+  while ((left = (int)(end - nowMs())) > 0)
+  {
+    struct pollfd pfd = {B.fd, POLLIN, 0};
+    if (poll(&pfd, 1, left) > 0 && read(B.fd, buf, sizeof(buf)) <= 0)
+      return;
+  }
+  B.taillen = 0;
+}
+
+/* results */
+
+struct benchStats *benchSection(const char *name)
+{
+  B.stats = realloc(B.stats, sizeof(struct benchStats) * (B.nstats + 1));
+  struct benchStats *st = &B.stats[B.nstats++];
+  memset(st, 0, sizeof(*st));
+  snprintf(st->name, sizeof(st->name), "%s", name);
+  return st;
+}
+
+/* sends bytes in one write and times the frames they produce */
+void benchEvent(struct benchStats *st, const char *bytes, int len, int frames)
+{
+  double start = nowMs();
+  if (write(B.fd, bytes, len) != len)
+    die("write");
+  long long n = benchAwaitFrames(frames);
+  if (st->nlat == st->caplat)
+  {
+    st->caplat = st->caplat ? st->caplat * 2 : 64;
+    st->lat = realloc(st->lat, sizeof(double) * st->caplat);
+  }
+  st->lat[st->nlat++] = nowMs() - start;
+  st->bytes += n;
+  st->frames += frames;
+}
+
+int cmpDouble(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+double percentile(double *v, int n, double p)
+{
+  int k = (int)(p * (n - 1) + 0.5);
+  return v[k];
+}
+
+void benchReport(void)
+{
+  printf("%-12s %7s %9s %9s %9s %12s\n", "trace", "events", "p50 ms", "p99 ms", "max ms", "bytes/frame");
+  for (int i = 0; i < B.nstats; i++)
+  {
+    struct benchStats *st = &B.stats[i];
+    if (st->nlat == 0)
+      continue;
+    qsort(st->lat, st->nlat, sizeof(double), cmpDouble);
+    printf("%-12s %7d %9.3f %9.3f %9.3f %12lld\n", st->name, st->nlat,
+           percentile(st->lat, st->nlat, 0.50), percentile(st->lat, st->nlat, 0.99),
+           st->lat[st->nlat - 1], st->frames ? st->bytes / st->frames : 0);
+  }
+}
+
+/* trace replay */
+
+void benchRun(const char *trace)
+{
+  struct benchStats *st = benchSection("trace");
+  char *copy = strdup(trace);
+  char *save;
+  for (char *line = strtok_r(copy, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+  {
+    char *arg = strchr(line, ' ');
+    if (arg)
+      *arg++ = '\0';
+    else
+      arg = "";
+    char bytes[4096];
+
+    if (!strcmp(line, "trace"))
+    {
+      st = benchSection(arg);
+    }
+    else if (!strcmp(line, "key"))
+    {
+      int n = unescape(arg, bytes, sizeof(bytes));
+      benchEvent(st, bytes, n, 1);
+    }
+    else if (!strcmp(line, "repeat"))
+    {
+      int times = atoi(arg);
+      char *keys = strchr(arg, ' ');
+      int n = keys ? unescape(keys + 1, bytes, sizeof(bytes)) : 0;
+      for (int i = 0; i < times && n > 0; i++)
+        benchEvent(st, bytes, n, 1);
+    }
+    else if (!strcmp(line, "type"))
+    {
+      int n = unescape(arg, bytes, sizeof(bytes));
+      for (int i = 0; i < n; i++)
+        benchEvent(st, &bytes[i], 1, 1);
+    }
+    else if (!strcmp(line, "paste"))
+    {
+      int n = unescape(arg, bytes, sizeof(bytes));
+      benchEvent(st, bytes, n, n);
+    }
+    else if (!strcmp(line, "wait"))
+    {
+      benchDrain(atoi(arg));
+    }
+    else if (line[0] && line[0] != '#')
+    {
+      fprintf(stderr, "bench: unknown trace command '%s'\n", line);
+      exit(1);
+    }
+  }
+  free(copy);
+}
+
+char *readFile(const char *path, long *len)
+{
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    die(path);
+  fseek(fp, 0, SEEK_END);
+  *len = ftell(fp);
+  rewind(fp);
+  char *buf = malloc(*len + 1);
+  if (fread(buf, 1, *len, fp) != (size_t)*len)
+    die(path);
+  buf[*len] = '\0';
+  fclose(fp);
+  return buf;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 3)
+  {
+    fprintf(stderr, "usage: %s CTEXT FIXTURE [TRACE]\n", argv[0]);
+    return 1;
+  }
+  char *ctext = realpath(argv[1], NULL);
+  if (!ctext)
+    die(argv[1]);
+
+  /* edit a copy in a scratch directory, so the fixture and any journal
+     ctext leaves behind stay out of the tree */
+  char dir[] = "/tmp/ctext-bench-XXXXXX";
+  if (!mkdtemp(dir))
+    die("mkdtemp");
+  const char *base = strrchr(argv[2], '/') ? strrchr(argv[2], '/') + 1 : argv[2];
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", dir, base);
+  long len;
+  char *fixture = readFile(argv[2], &len);
+  FILE *fp = fopen(path, "w");
+  if (!fp || fwrite(fixture, 1, len, fp) != (size_t)len || fclose(fp) == EOF)
+    die(path);
+  free(fixture);
+
+  char *trace = argc > 3 ? readFile(argv[3], &len) : strdup(default_trace);
+
+  benchSpawn(ctext, path);
+  benchAwaitFrames(1);
+  benchDrain(200);
+  benchRun(trace);
+
+  /* quit, confirming away the unsaved changes */
+  for (int i = 0; i < 4; i++)
+  {
+    if (write(B.fd, "\x18", 1) != 1)
+      break;
+    benchDrain(20);
+  }
+  int status;
+  double deadline = nowMs() + 2000;
+  while (waitpid(B.pid, &status, WNOHANG) == 0)
+  {
+    if (nowMs() > deadline)
+    {
+      kill(B.pid, SIGKILL);
+      waitpid(B.pid, &status, 0);
+      break;
+    }
+    benchDrain(10);
+  }
+  close(B.fd);
+
+  benchReport();
+
+  char cmd[4200];
+  snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+  if (system(cmd) != 0)
+    fprintf(stderr, "bench: could not remove %s\n", dir);
+  free(trace);
+  free(ctext);
+  return 0;
+}
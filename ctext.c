@@ -1,4 +1,8 @@
 /* Includes */
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
@@ -11,11 +15,32 @@
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /* Defines */
 #define CTEXT_VERSION "0.0.1"
 #define TAB_STOP 2
 #define QUIT_TIMES 3
+#define JOURNAL_BATCH 4096
+#define JOURNAL_FLUSH_SECS 1
+#define JOURNAL_COMPACT (1 << 20)
+#define GZ_SLICE (1 << 18)
+#define GZ_FAST_BITS 10
+#define HELP_MESSAGE "HELP: Ctrl-X = quit | Ctrl-S = save | Ctrl-F = find | Ctrl-W = wrap | Ctrl-N/P = next/prev word | Ctrl-B/C/K/V = mark/copy/cut/paste | Ctrl-T = memory"
 
 #define CTRL_KEY(k) (k & 0x1f)
 
@@ -44,21 +69,182 @@ enum editorKey
   PAGE_DOWN
 };
 
+enum journalOp {
+  J_INSROW = 1,
+  J_DELROW,
+  J_INSCHAR,
+  J_DELCHAR,
+  J_APPEND,
+  J_TRUNC,
+  J_COMMIT,
+  J_YANK,
+  J_DELROWS,
+  J_PASTE,
+  J_CLIP,
+  J_BULK,
+  J_TEXT
+};
+
+enum gzMode {
+  GZ_MEMBER = 0,
+  GZ_BLOCK,
+  GZ_STORED,
+  GZ_CODES,
+  GZ_TRAILER,
+  GZ_DONE
+};
+
+enum memTag {
+  MEM_ROWS = 0,
+  MEM_CHARS,
+  MEM_RENDER,
+  MEM_HL,
+  MEM_WRAP,
+  MEM_INDEX,
+  MEM_SCREEN,
+  MEM_SEARCH,
+  MEM_JOURNAL,
+  MEM_CLIP,
+  MEM_GZIP,
+  MEM_CACHE,
+  MEM_TAGS
+};
+
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+/* character classes in EditorSyntax.cclass */
+#define CC_SEP (1<<0)
+#define CC_DIGIT (1<<1)
+#define CC_WORD (1<<2)
+#define CC_QUOTE (1<<3)
+#define CC_COMMENT (1<<4)
+#define CC_KEYWORD (1<<5)
+#define CC_OPEN (CC_QUOTE | CC_COMMENT)
+
+/* Memory accounting */
+
+/* The editor's own data structures are allocated through these wrappers.
+   Each block carries a header with its size and subsystem, so live bytes
+   and block counts can be reported per subsystem. Blocks can be shared by
+   reference count, a shared block is copied before it is resized. */
+typedef union memHeader
+{
+  struct
+  {
+    size_t size;
+    int tag;
+    int refs;
+  } h;
+  long double align;
+} memHeader;
+
+struct memCounter
+{
+  long long bytes;
+  long long blocks;
+};
+
+const char* mem_names[MEM_TAGS] = {
+  "rows", "chars", "render", "hl", "wrap", "index", "screen", "search", "journal", "clip", "gzip", "cache"
+};
+struct memCounter mem_stats[MEM_TAGS];
+long long mem_live = 0;
+long long mem_peak = 0;
+
+void memCount(int tag, long long size, int blocks){
+  mem_stats[tag].bytes += size;
+  mem_stats[tag].blocks += blocks;
+  mem_live += size;
+  if (mem_live > mem_peak) mem_peak = mem_live;
+}
+
+void* memRealloc(int tag, void* p, size_t size){
+  memHeader* h = NULL;
+  if (p){
+    h = (memHeader*)p - 1;
+    tag = h->h.tag;
+    if (h->h.refs > 1){
+      void* copy = memRealloc(tag, NULL, size);
+      if (copy == NULL) return NULL;
+      memcpy(copy, p, size < h->h.size ? size : h->h.size);
+      h->h.refs--;
+      return copy;
+    }
+    memCount(tag, -(long long)h->h.size, -1);
+  }
+  memHeader* n = realloc(h, sizeof(memHeader) + size);
+  if (n == NULL){
+    if (h) memCount(tag, h->h.size, 1);
+    return NULL;
+  }
+  n->h.size = size;
+  n->h.tag = tag;
+  n->h.refs = 1;
+  memCount(tag, size, 1);
+  return n + 1;
+}
+
+void* memAlloc(int tag, size_t size){
+  return memRealloc(tag, NULL, size);
+}
+
+void* memCalloc(int tag, size_t n, size_t size){
+  void* p = memAlloc(tag, n * size);
+  if (p) memset(p, 0, n * size);
+  return p;
+}
+
+void* memShare(void* p){
+  if (p) ((memHeader*)p - 1)->h.refs++;
+  return p;
+}
+
+/* returns a block that can be written in place */
+void* memUnshare(void* p){
+  if (p == NULL || ((memHeader*)p - 1)->h.refs == 1) return p;
+  return memRealloc(0, p, ((memHeader*)p - 1)->h.size);
+}
+
+void memFree(void* p){
+  if (p == NULL) return;
+  memHeader* h = (memHeader*)p - 1;
+  if (h->h.refs > 1){
+    h->h.refs--;
+    return;
+  }
+  memCount(h->h.tag, -(long long)h->h.size, -1);
+  free(h);
+}
+
+/* peak resident set size in bytes */
+long long memPeakRss(void){
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == -1) return 0;
+  return (long long)ru.ru_maxrss * 1024;
+}
+
+char* memFormat(long long bytes, char* buf, int size){
+  if (bytes < 1024) snprintf(buf, size, "%lldB", bytes);
+  else if (bytes < 1024 * 1024) snprintf(buf, size, "%.1fK", bytes / 1024.0);
+  else if (bytes < 1024LL * 1024 * 1024) snprintf(buf, size, "%.1fM", bytes / (1024.0 * 1024));
+  else snprintf(buf, size, "%.1fG", bytes / (1024.0 * 1024 * 1024));
+  return buf;
+}
+
 /* Append Buffer */
 struct abuff
 {
   char *b;
   int len;
+  int tag;
 };
 
-#define ABUFF_INIT {NULL, 0}
+#define ABUFF_INIT {NULL, 0, MEM_SCREEN}
 
 void abAppend(struct abuff *ab, const char *s, int len)
 {
-  char *new = realloc(ab->b, ab->len + len);
+  char *new = memRealloc(ab->tag, ab->b, ab->len + len);
 
   if (new == NULL)
     return;
@@ -69,7 +255,7 @@ void abAppend(struct abuff *ab, const char *s, int len)
 
 void abFree(struct abuff *ab)
 {
-  free(ab->b);
+  memFree(ab->b);
 }
 
 /* Prototypes */
@@ -79,6 +265,29 @@ void editorSetStatusMessage(const char* fmt, ...);
 void editorRefreshScreen(void);
 char* editorPrompt(char *promptFmt, void(*callback)(char *, int));
 void editorSelectSyntaxHighlight(void);
+void editorHandleResize(void);
+int editorSaveJob(int* redraw);
+void editorJournalRecord(int op, int a, int b, const char* s, int len);
+void editorJournalFlush(void);
+void editorJournalCompactCancel(void);
+int editorJournalJob(int* redraw);
+void editorJournalRecover(void);
+void editorJournalRebase(off_t from);
+void editorJournalDiscard(void);
+int editorGzipJob(int* redraw);
+void editorGzipFinish(void);
+void editorOpenGzip(char* filename);
+int editorIsBinary(const char* filename);
+void editorOpenHex(char* filename);
+void editorDrawSetColor(struct abuff *ab, int color);
+int editorCacheLoad(const char* filename);
+void editorCacheStore(const char* filename);
+int editorStaleJob(int* redraw);
+int editorHighlightJob(int* redraw);
+int editorRunJobs(void);
+void initEditor(void);
+int editorScreenLimit(void);
+void editorInstallSignals(void);
 
 /* Data */
 
@@ -92,6 +301,42 @@ struct EditorSyntax {
   int flags;
 };
 
+struct EditorClasses {
+  int ready;
+  unsigned char cclass[256];
+  int vscan;
+  unsigned char open[4];
+  int nopen;
+};
+
+typedef struct hlspan
+{
+  int start;
+  int len;
+  unsigned char hl;
+} hlspan;
+
+typedef struct ident
+{
+  char* name;
+  int len;
+  unsigned int hash;
+  int total;
+  int* rows;
+  int nrows;
+  int caprows;
+  int stamp;
+  int slot;
+  int pins;
+  struct ident* next;
+} ident;
+
+struct rowIdent
+{
+  ident* id;
+  int count;
+};
+
 typedef struct erow
 {
   int idx;
@@ -99,10 +344,154 @@ typedef struct erow
   int rsize;
   char *chars;
   char* render;
-  unsigned char* hl;
+  hlspan* hl;
+  int hlsize;
   int hl_open_comment;
+  int wrapheight;
+  int ascii;
+  int rwidth;
+  int* rcol;
+  int uid;
+  struct rowIdent* idents;
+  int nidents;
+  int stale;
+  unsigned gen;
+  int disksize;
 } erow;
 
+void editorRenderRow(erow* row);
+void editorUpdateRow(erow* row);
+
+struct EditorSave
+{
+  pid_t pid;
+  int progressfd;
+  long long total;
+  long long written;
+  int dirty;
+  off_t journaloff;
+  unsigned gen;
+};
+
+/* see editorTrackTouch */
+struct EditorTrack
+{
+  unsigned gen;
+  unsigned savegen;
+  int lo;
+  int reshaped;
+  int exact;
+  off_t size;
+  struct timespec mtime;
+};
+
+struct EditorJournal
+{
+  int enabled;
+  int replaying;
+  int fd;
+  char* path;
+  struct abuff buf;
+  pid_t compactpid;
+  int compactfd;
+  off_t compactfrom;
+};
+
+struct gzHuffman
+{
+  short count[16];
+  short symbol[288];
+  unsigned short fast[1 << GZ_FAST_BITS];
+};
+
+struct EditorGzip
+{
+  int active;
+  unsigned char* in;
+  size_t inlen;
+  size_t pos;
+  uint64_t bitbuf;
+  int bitcnt;
+  int mode;
+  int last;
+  unsigned stored;
+  int members;
+  const char* err;
+  struct gzHuffman dynlen, dyndist;
+  struct gzHuffman *lencode, *distcode;
+  unsigned char* window;
+  uint64_t whave;
+  unsigned char* out;
+  int outlen;
+  int crcpos;
+  uint32_t crc;
+  uint32_t size;
+  struct abuff line;
+};
+
+struct EditorClip
+{
+  struct erow* rows;
+  int numrows;
+  int open_comment;
+  int journaled;
+};
+
+struct EditorCache
+{
+  int enabled;
+  int stale;
+  int next;
+};
+
+struct EditorIndex
+{
+  ident** table;
+  int cap;
+  int count;
+  int stamp;
+  int* uidrow;
+  int uidcap;
+  int nextuid;
+  int* freeuids;
+  int nfree;
+  int freecap;
+};
+
+struct EditorHex
+{
+  int active;
+  unsigned char* map;
+  long long size;
+  long long cur;
+  long long top;
+  int width;
+  int digits;
+  unsigned char* pat;
+  int patlen;
+  long long match;
+  long long origin;
+};
+
+/* an editor session served to ctext -a, see the server section */
+struct EditorAttach
+{
+  int active;
+  int holding;
+  int rows, cols;
+};
+
+struct EditorFrame
+{
+  struct abuff* lines;
+  struct abuff* next;
+  int rows, cols;
+  long long rowoff;
+  int coloff;
+  int softwrap;
+  int valid;
+};
+
 struct EditorState
 {
   int cx, cy;
@@ -111,16 +500,38 @@ struct EditorState
   int numrows;
   int rowoff, coloff;
   erow *rows;
+  int softwrap;
+  int* wraptree;
+  int wrapsize;
+  int wrapcols;
+  int wrapfrom;
   int dirty;
   char* filename;
-  char statusmsg[80];
+  char statusmsg[160];
   time_t statusmsg_time;
+  struct EditorSave save;
+  struct EditorTrack track;
+  int gutter;
+  struct EditorJournal journal;
+  struct EditorGzip gz;
+  struct EditorHex hex;
+  struct EditorCache cache;
+  struct EditorIndex index;
+  struct EditorClip clip;
+  int mark;
+  struct EditorFrame frame;
   struct EditorSyntax* syntax;
+  struct EditorClasses* classes;
+  int hlfrom, hlto;
+  struct EditorAttach attach;
   struct termios orig_termios;
 };
 
 struct EditorState E;
 
+volatile sig_atomic_t winch_pending = 0;
+volatile sig_atomic_t hangup_pending = 0;
+
 /* filetypes */
 
 char* C_HL_extensions[] = { ".c", ".h", ".cpp", ".hpp", NULL };
@@ -145,9 +556,12 @@ struct EditorSyntax HLDB[] = {
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+struct EditorClasses HLCLASSES[HLDB_ENTRIES];
+
 /* Terminal */
 void die(const char *s)
 {
+  editorJournalFlush();
   editorClearScreen();
   perror(s);
   exit(1);
@@ -179,30 +593,79 @@ void enableRawMode(void)
     die("tcsetattr enableRawMode");
 }
 
+/* Reads a byte like read(2) on the raw terminal, which gives up after
+   VTIME. An attached session reads a socket, so it waits with poll instead
+   and takes the end of the stream as a hangup. */
+int editorReadByte(char *c)
+{
+  if (!E.attach.active)
+    return read(STDIN_FILENO, c, 1);
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  int ready = poll(&pfd, 1, 100);
+  if (ready <= 0)
+    return ready;
+  int nread = read(STDIN_FILENO, c, 1);
+  if (nread == 0)
+    hangup_pending = 1;
+  return nread;
+}
+
+/* the rest of an ESC [ 8 ; rows ; cols t window size report */
+void editorReadResize(void)
+{
+  char buf[16];
+  unsigned i = 0;
+  while (i < sizeof(buf) - 1 && editorReadByte(&buf[i]) == 1 && buf[i] != 't')
+    i++;
+  buf[i] = '\0';
+  int rows, cols;
+  if (sscanf(buf, "%d;%d", &rows, &cols) != 2 || rows < 3 || cols < 1)
+    return;
+  E.attach.rows = rows;
+  E.attach.cols = cols;
+  editorHandleResize();
+}
+
 int editorReadKey(void)
 {
   int nread;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, sizeof(char))) != 1)
+  while ((nread = editorReadByte(&c)) != 1)
   {
-    if (nread == -1 && errno != EAGAIN)
+    if (nread == -1 && errno != EAGAIN && errno != EINTR)
       die("read");
+    if (winch_pending){
+      editorHandleResize();
+      editorRefreshScreen();
+    }
+    if (hangup_pending){
+      editorJournalFlush();
+      tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios);
+      _exit(1);
+    }
+    if (editorRunJobs())
+      editorRefreshScreen();
   }
 
   if (c == '\x1b')
   {
     char seq[3];
-    if (read(STDIN_FILENO, &seq[0], 1) != 1)
+    if (editorReadByte(&seq[0]) != 1)
       return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1)
+    if (editorReadByte(&seq[1]) != 1)
       return '\x1b';
 
     if (seq[0] == '[')
     {
       if (seq[1] >= '0' && seq[1] <= '9')
       {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1)
+        if (editorReadByte(&seq[2]) != 1)
           return '\x1b';
+        if (seq[1] == '8' && seq[2] == ';' && E.attach.active)
+        {
+          editorReadResize();
+          return CTRL_KEY('l');
+        }
         if (seq[2] == '~')
         {
           switch (seq[1])
@@ -247,7 +710,7 @@ int editorReadKey(void)
   }
   else
   {
-    return c;
+    return (unsigned char)c;
   }
 }
 
@@ -280,6 +743,12 @@ int getCursorPosition(int *rows, int *cols)
 int getWindowSize(int *rows, int *cols)
 {
   struct winsize ws;
+  if (E.attach.active)
+  {
+    *rows = E.attach.rows;
+    *cols = E.attach.cols;
+    return 0;
+  }
   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
   {
     if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
@@ -294,181 +763,1142 @@ int getWindowSize(int *rows, int *cols)
   }
 }
 
-/* file i/o  */
+void handleSigWinch(int sig)
+{
+  (void)sig;
+  winch_pending = 1;
+}
 
-char* editorRowsToString(int *buflen){
-  int totlen = 0;
-  int i;
-  for (i = 0; i < E.numrows; i++){
-    totlen += E.rows[i].size + 1;
-  }
-  *buflen = totlen;
+void handleSigHangup(int sig)
+{
+  (void)sig;
+  hangup_pending = 1;
+}
 
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (i = 0; i < E.numrows; i++){
-    memcpy(p, E.rows[i].chars, E.rows[i].size);
-    p += E.rows[i].size;
-    *p = '\n';
-    p++;
-  }
-  return buf;
+void editorHandleResize(void)
+{
+  winch_pending = 0;
+  if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+    die("getWindowSize");
+  E.screenrows -= 2;
+  E.screencols -= E.gutter;
+  E.wrapcols = 0;
+  E.frame.valid = 0;
 }
 
-void editorOpen(char *filename)
+/* background jobs */
+
+/* Work that outlasts a keypress runs as jobs from the idle loop in
+   editorReadKey, lowest id first. A step does one bounded slice and
+   returns the ms until it wants to run again, 0 for at once or JOB_DONE,
+   and sets *redraw when the screen changed. The loop goes back to input as
+   soon as a key or signal is waiting, so no job holds up typing by more
+   than a slice. */
+
+#define JOB_DONE -1
+#define JOB_FRAME_MS 100
+
+enum editorJobId {
+  JOB_SAVE = 0,
+  JOB_JOURNAL,
+  JOB_HIGHLIGHT,
+  JOB_GZIP,
+  JOB_STALE,
+  JOBS
+};
+
+struct editorJob
 {
-  free(E.filename);
-  E.filename = strdup(filename);
-  editorSelectSyntaxHighlight();
-  FILE *fp = fopen(filename, "r");
-  if (!fp)
-    die("fopen");
+  int (*step)(int* redraw);
+  int active;
+  long long due;
+};
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
+struct editorJob jobs[JOBS] = {
+  [JOB_SAVE] = { editorSaveJob, 0, 0 },
+  [JOB_JOURNAL] = { editorJournalJob, 0, 0 },
+  [JOB_HIGHLIGHT] = { editorHighlightJob, 0, 0 },
+  [JOB_GZIP] = { editorGzipJob, 0, 0 },
+  [JOB_STALE] = { editorStaleJob, 0, 0 },
+};
 
-  while ((linelen = getline(&line, &linecap, fp)) != -1)
-  {
-    while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-    {
-      linelen--;
-    }
-    editorInsertRow(E.numrows, line, linelen);
-  }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
+long long editorNowMs(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
-void editorSave(void) {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s", NULL);
-    if (E.filename == NULL){
-      editorSetStatusMessage("Save aborted");
-      return;
+/* schedules job id to run in delay ms, or sooner if it already is */
+void editorJobStart(int id, int delay){
+  long long due = editorNowMs() + delay;
+  if (!jobs[id].active || due < jobs[id].due) jobs[id].due = due;
+  jobs[id].active = 1;
+}
+
+/* Runs due jobs until input is waiting or none are due. Redraws at most
+   every JOB_FRAME_MS on the way and returns 1 if one is still owed. */
+int editorRunJobs(void){
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  long long shown = editorNowMs();
+  int redraw = 0;
+  for (;;){
+    long long now = editorNowMs();
+    int id = 0;
+    while (id < JOBS && !(jobs[id].active && jobs[id].due <= now)) id++;
+    if (id == JOBS) break;
+    int delay = jobs[id].step(&redraw);
+    if (delay == JOB_DONE) jobs[id].active = 0;
+    else jobs[id].due = now + delay;
+    if (winch_pending || hangup_pending || poll(&pfd, 1, 0) > 0) break;
+    if (redraw && now - shown >= JOB_FRAME_MS){
+      editorRefreshScreen();
+      shown = now;
+      redraw = 0;
     }
-    editorSelectSyntaxHighlight();
   }
-  int len;
-  char* buf = editorRowsToString(&len);
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1){
-    if(ftruncate(fd, len) != -1){
-      if(write(fd, buf, len) == len){
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
+  return redraw;
+}
+
+/* gzip */
+
+/* .gz files are inflated by a small built-in DEFLATE decoder (RFC 1951,
+   1952). The compressed file is read whole, since it is what bounds
+   memory, and decoded a slice at a time: the first screen is decoded
+   before the editor starts and the rest by a background job, yielding as
+   soon as a key is waiting. Decoded rows are kept like any other rows, so
+   moving around the file never decodes anything twice. */
+
+const short gz_lbase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+const short gz_lext[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+const short gz_dbase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+  8193, 12289, 16385, 24577
+};
+const short gz_dext[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+uint32_t gz_crctable[256];
+
+uint32_t gzCrc(uint32_t crc, const unsigned char* s, size_t len){
+  if (gz_crctable[1] == 0){
+    for (uint32_t n = 0; n < 256; n++){
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      gz_crctable[n] = c;
     }
-    close(fd);
   }
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  crc = ~crc;
+  while (len--) crc = gz_crctable[(crc ^ *s++) & 0xff] ^ (crc >> 8);
+  return ~crc;
 }
 
-/* syntax highlighting */
-
-int is_separator(int c){
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+void gzFill(struct EditorGzip* z){
+  while (z->bitcnt <= 56 && z->pos < z->inlen){
+    z->bitbuf |= (uint64_t)z->in[z->pos++] << z->bitcnt;
+    z->bitcnt += 8;
+  }
 }
 
-void editorUpdateSyntax(erow* row){
-	row->hl = realloc(row->hl, row->rsize);
-	memset(row->hl, HL_NORMAL, row->rsize);
+unsigned gzBits(struct EditorGzip* z, int n){
+  if (z->bitcnt < n) gzFill(z);
+  if (z->bitcnt < n){
+    z->err = "unexpected end of file";
+    return 0;
+  }
+  unsigned v = (unsigned)(z->bitbuf & ((1ULL << n) - 1));
+  z->bitbuf >>= n;
+  z->bitcnt -= n;
+  return v;
+}
 
-  if (E.syntax == NULL) return;
+/* Builds a canonical code from code lengths. Codes up to GZ_FAST_BITS
+   long are resolved by one table lookup. Returns < 0 if over-subscribed. */
+int gzBuild(struct gzHuffman* h, const short* length, int n){
+  short offs[16];
+  memset(h->count, 0, sizeof(h->count));
+  memset(h->fast, 0, sizeof(h->fast));
+  for (int sym = 0; sym < n; sym++) h->count[length[sym]]++;
+  if (h->count[0] == n) return 0;
 
-  char **keywords = E.syntax->keywords;
+  int left = 1;
+  for (int len = 1; len < 16; len++){
+    left <<= 1;
+    left -= h->count[len];
+    if (left < 0) return left;
+  }
+  offs[1] = 0;
+  for (int len = 1; len < 15; len++) offs[len + 1] = offs[len] + h->count[len];
+  for (int sym = 0; sym < n; sym++)
+    if (length[sym]) h->symbol[offs[length[sym]]++] = sym;
 
-  char* scs = E.syntax->singleline_comment_start;
-  char* mcs = E.syntax->multiline_comment_start;
-  char* mce = E.syntax->multiline_comment_end;
+  int code = 0, index = 0;
+  for (int len = 1; len <= GZ_FAST_BITS; len++){
+    for (int k = 0; k < h->count[len]; k++){
+      int rev = 0;
+      for (int b = 0; b < len; b++) rev |= ((code >> b) & 1) << (len - 1 - b);
+      for (int fill = rev; fill < (1 << GZ_FAST_BITS); fill += 1 << len)
+        h->fast[fill] = (len << 9) | h->symbol[index];
+      index++;
+      code++;
+    }
+    code <<= 1;
+  }
+  return left;
+}
 
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
+int gzDecode(struct EditorGzip* z, const struct gzHuffman* h){
+  if (z->bitcnt < 15) gzFill(z);
+  unsigned e = h->fast[z->bitbuf & ((1 << GZ_FAST_BITS) - 1)];
+  if (e && (int)(e >> 9) <= z->bitcnt){
+    z->bitbuf >>= e >> 9;
+    z->bitcnt -= e >> 9;
+    return e & 511;
+  }
+  int code = 0, first = 0, index = 0;
+  uint64_t bits = z->bitbuf;
+  for (int len = 1; len <= 15 && len <= z->bitcnt; len++){
+    code |= bits & 1;
+    bits >>= 1;
+    int count = h->count[len];
+    if (code - count < first){
+      z->bitbuf >>= len;
+      z->bitcnt -= len;
+      return h->symbol[index + (code - first)];
+    }
+    index += count;
+    first += count;
+    first <<= 1;
+    code <<= 1;
+  }
+  z->err = "invalid code";
+  return -1;
+}
 
+void gzFixedTables(struct EditorGzip* z){
+  static struct gzHuffman lencode, distcode;
+  static int built = 0;
+  if (!built){
+    short lengths[288];
+    int sym = 0;
+    for (; sym < 144; sym++) lengths[sym] = 8;
+    for (; sym < 256; sym++) lengths[sym] = 9;
+    for (; sym < 280; sym++) lengths[sym] = 7;
+    for (; sym < 288; sym++) lengths[sym] = 8;
+    gzBuild(&lencode, lengths, 288);
+    for (sym = 0; sym < 30; sym++) lengths[sym] = 5;
+    gzBuild(&distcode, lengths, 30);
+    built = 1;
+  }
+  z->lencode = &lencode;
+  z->distcode = &distcode;
+}
 
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->idx > 0 && E.rows[row->idx - 1].hl_open_comment);
+void gzDynamicTables(struct EditorGzip* z){
+  static const short order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+  short lengths[320];
+  struct gzHuffman lencode;
 
-  int i = 0;
-  while (i < row->rsize){
-    char c = row->render[i];
-    unsigned char prev_hl = (i>0) ? row->hl[i - 1] : HL_NORMAL;
+  int nlen = gzBits(z, 5) + 257;
+  int ndist = gzBits(z, 5) + 1;
+  int ncode = gzBits(z, 4) + 4;
+  if (nlen > 286 || ndist > 30){
+    z->err = "bad table sizes";
+    return;
+  }
+  memset(lengths, 0, sizeof(lengths));
+  for (int i = 0; i < ncode; i++) lengths[order[i]] = gzBits(z, 3);
+  if (gzBuild(&lencode, lengths, 19) != 0){
+    z->err = "bad code lengths";
+    return;
+  }
 
-    if (scs_len && !in_string && !in_comment){
-      if(!strncmp(&row->render[i], scs, scs_len)){
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
+  int index = 0;
+  while (index < nlen + ndist && !z->err){
+    int sym = gzDecode(z, &lencode);
+    if (sym < 0) return;
+    if (sym < 16){
+      lengths[index++] = sym;
+      continue;
+    }
+    int len = 0;
+    if (sym == 16){
+      if (index == 0){
+        z->err = "repeat with no length";
+        return;
       }
+      len = lengths[index - 1];
+      sym = 3 + gzBits(z, 2);
+    } else if (sym == 17){
+      sym = 3 + gzBits(z, 3);
+    } else {
+      sym = 11 + gzBits(z, 7);
+    }
+    if (index + sym > nlen + ndist){
+      z->err = "too many lengths";
+      return;
     }
+    while (sym--) lengths[index++] = len;
+  }
+  if (z->err) return;
+  if (lengths[256] == 0 ||
+      gzBuild(&z->dynlen, lengths, nlen) < 0 ||
+      gzBuild(&z->dyndist, lengths + nlen, ndist) < 0){
+    z->err = "bad literal/length or distance code";
+    return;
+  }
+  z->lencode = &z->dynlen;
+  z->distcode = &z->dyndist;
+}
 
-    if (mcs_len && mce_len && !in_string){
-      if (in_comment){
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)){
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        }
-        i++;
-        continue;
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)){
-          memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-          i += mcs_len;
-          in_comment = 1;
-          continue;
-        }
+void gzPut(struct EditorGzip* z, unsigned char c){
+  z->window[z->whave++ & 0x7fff] = c;
+  z->out[z->outlen++] = c;
+}
+
+void gzMember(struct EditorGzip* z){
+  z->bitbuf >>= z->bitcnt & 7;
+  z->bitcnt -= z->bitcnt & 7;
+  if (z->bitcnt == 0 && z->pos >= z->inlen){
+    z->mode = GZ_DONE;
+    return;
+  }
+  unsigned id1 = gzBits(z, 8);
+  unsigned id2 = gzBits(z, 8);
+  if (id1 != 0x1f || id2 != 0x8b){
+    /* trailing garbage after a member is ignored, like gzip does */
+    if (z->members){
+      z->err = NULL;
+      z->mode = GZ_DONE;
+    } else {
+      z->err = "not in gzip format";
     }
+    return;
+  }
+  if (gzBits(z, 8) != 8){
+    z->err = "unknown compression method";
+    return;
+  }
+  int flags = gzBits(z, 8);
+  for (int i = 0; i < 6; i++) gzBits(z, 8);
+  if (flags & 4){
+    int xlen = gzBits(z, 16);
+    while (xlen-- > 0 && !z->err) gzBits(z, 8);
+  }
+  if (flags & 8) while (gzBits(z, 8) && !z->err);
+  if (flags & 16) while (gzBits(z, 8) && !z->err);
+  if (flags & 2) gzBits(z, 16);
+  z->crc = 0;
+  z->crcpos = z->outlen;
+  z->size = 0;
+  z->whave = 0;
+  z->members++;
+  z->mode = GZ_BLOCK;
+}
 
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS){
-      if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize){
-          row->hl[i+1] = HL_STRING;
-          i += 2;
+void gzTrailer(struct EditorGzip* z){
+  z->crc = gzCrc(z->crc, &z->out[z->crcpos], z->outlen - z->crcpos);
+  z->size += z->outlen - z->crcpos;
+  z->crcpos = z->outlen;
+  z->bitbuf >>= z->bitcnt & 7;
+  z->bitcnt -= z->bitcnt & 7;
+  uint32_t crc = gzBits(z, 16);
+  crc |= (uint32_t)gzBits(z, 16) << 16;
+  uint32_t size = gzBits(z, 16);
+  size |= (uint32_t)gzBits(z, 16) << 16;
+  if (z->err) return;
+  if (crc != z->crc || size != z->size){
+    z->err = "checksum mismatch";
+    return;
+  }
+  z->mode = GZ_MEMBER;
+}
+
+/* inflates into z->out until it holds about GZ_SLICE bytes or the input
+   ends, returns the number of bytes produced */
+int gzInflate(struct EditorGzip* z){
+  z->outlen = 0;
+  z->crcpos = 0;
+  while (!z->err && z->mode != GZ_DONE && z->outlen < GZ_SLICE){
+    switch (z->mode){
+    case GZ_MEMBER:
+      gzMember(z);
+      break;
+    case GZ_BLOCK:
+    {
+      z->last = gzBits(z, 1);
+      int type = gzBits(z, 2);
+      if (type == 0){
+        z->bitbuf >>= z->bitcnt & 7;
+        z->bitcnt -= z->bitcnt & 7;
+        unsigned len = gzBits(z, 16);
+        if (gzBits(z, 16) != (~len & 0xffff) && !z->err) z->err = "bad stored block";
+        z->stored = len;
+        z->mode = GZ_STORED;
+      } else if (type == 1){
+        gzFixedTables(z);
+        z->mode = GZ_CODES;
+      } else if (type == 2){
+        gzDynamicTables(z);
+        z->mode = GZ_CODES;
+      } else {
+        z->err = "bad block type";
+      }
+      break;
+    }
+    case GZ_STORED:
+      while (z->stored > 0 && z->outlen < GZ_SLICE && !z->err){
+        gzPut(z, gzBits(z, 8));
+        z->stored--;
+      }
+      if (z->stored == 0) z->mode = z->last ? GZ_TRAILER : GZ_BLOCK;
+      break;
+    case GZ_CODES:
+      while (z->outlen < GZ_SLICE){
+        int sym = gzDecode(z, z->lencode);
+        if (sym < 0) break;
+        if (sym < 256){
+          gzPut(z, sym);
           continue;
         }
-        if (c == in_string) in_string = 0;
-        i++;
+        if (sym == 256){
+          z->mode = z->last ? GZ_TRAILER : GZ_BLOCK;
+          break;
+        }
+        sym -= 257;
+        if (sym >= 29){
+          z->err = "invalid length symbol";
+          break;
+        }
+        int len = gz_lbase[sym] + gzBits(z, gz_lext[sym]);
+        int dsym = gzDecode(z, z->distcode);
+        if (dsym < 0) break;
+        if (dsym >= 30){
+          z->err = "invalid distance symbol";
+          break;
+        }
+        unsigned dist = gz_dbase[dsym] + gzBits(z, gz_dext[dsym]);
+        if (dist > z->whave || dist > 32768){
+          z->err = "distance too far back";
+          break;
+        }
+        while (len--) gzPut(z, z->window[(z->whave - dist) & 0x7fff]);
+      }
+      break;
+    case GZ_TRAILER:
+      gzTrailer(z);
+      break;
+    }
+  }
+  /* a member can end exactly at the slice end, its trailer is read in the
+     next call and must only see that call's bytes */
+  z->crc = gzCrc(z->crc, &z->out[z->crcpos], z->outlen - z->crcpos);
+  z->size += z->outlen - z->crcpos;
+  z->crcpos = z->outlen;
+  return z->outlen;
+}
+
+/* appends rows for a decoded slice, a line cut by the slice end is kept
+   until the next one */
+void editorGzipRows(const char* s, int len, int final){
+  int dirty = E.dirty;
+  int start = 0;
+  for (int i = 0; i <= len; i++){
+    if (i < len && s[i] != '\n') continue;
+    if (i == len && !final){
+      abAppend(&E.gz.line, &s[start], len - start);
+      break;
+    }
+    const char* line = &s[start];
+    int linelen = i - start;
+    if (E.gz.line.len){
+      abAppend(&E.gz.line, line, linelen);
+      line = E.gz.line.b;
+      linelen = E.gz.line.len;
+    }
+    if (i < len || linelen > 0){
+      while (linelen > 0 && line[linelen - 1] == '\r') linelen--;
+      editorInsertRow(E.numrows, (char*)line, linelen);
+      E.rows[E.numrows - 1].gen = 0;
+    }
+    E.gz.line.len = 0;
+    start = i + 1;
+  }
+  E.dirty = dirty;
+}
+
+/* decodes one slice, returns 0 once the file is done */
+int editorGzipStep(void){
+  struct EditorGzip* z = &E.gz;
+  if (!z->active) return 0;
+  int n = gzInflate(z);
+  int done = z->err || z->mode == GZ_DONE;
+  editorGzipRows((char*)z->out, n, done);
+  if (!done) return 1;
+
+  if (z->err)
+    editorSetStatusMessage("gzip: %s at byte %zu, %d lines read", z->err, z->pos, E.numrows);
+  else
+    editorSetStatusMessage("Inflated %d lines, Ctrl-S saves them uncompressed to %s", E.numrows, E.filename);
+  memFree(z->in);
+  memFree(z->window);
+  memFree(z->out);
+  abFree(&E.gz.line);
+  z->in = NULL;
+  z->window = NULL;
+  z->out = NULL;
+  E.gz.line.b = NULL;
+  z->active = 0;
+  return 0;
+}
+
+int editorGzipJob(int* redraw){
+  *redraw = 1;
+  return editorGzipStep() ? 0 : JOB_DONE;
+}
+
+void editorGzipFinish(void){
+  while (editorGzipStep());
+}
+
+void editorOpenGzip(char* filename){
+  struct EditorGzip* z = &E.gz;
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1)
+    die("open");
+  z->inlen = st.st_size;
+  z->in = memAlloc(MEM_GZIP, z->inlen ? z->inlen : 1);
+  size_t got = 0;
+  while (got < z->inlen){
+    ssize_t n = read(fd, z->in + got, z->inlen - got);
+    if (n <= 0)
+      die("read");
+    got += n;
+  }
+  close(fd);
+
+  free(E.filename);
+  E.filename = strdup(filename);
+  E.filename[strlen(filename) - 3] = '\0';
+  editorSelectSyntaxHighlight();
+
+  z->active = 1;
+  z->pos = 0;
+  z->bitbuf = 0;
+  z->bitcnt = 0;
+  z->mode = GZ_MEMBER;
+  z->members = 0;
+  z->err = NULL;
+  z->whave = 0;
+  z->window = memAlloc(MEM_GZIP, 32768);
+  z->out = memAlloc(MEM_GZIP, GZ_SLICE + 258);
+  E.gz.line = (struct abuff)ABUFF_INIT;
+  E.gz.line.tag = MEM_GZIP;
+
+  while (E.numrows <= E.screenrows && editorGzipStep());
+  E.dirty = 0;
+  if (z->active) editorJobStart(JOB_GZIP, 0);
+}
+
+/* change tracking */
+
+/* Every edit stamps its row with the next E.track.gen, so rows stamped
+   after E.track.savegen differ from the file. disksize is the length the
+   row had on disk, taken when it is first touched after a save, and -1
+   for rows inserted since. While the file is exactly the rows joined by
+   newlines (exact), a save rewrites only the changed rows in place, or
+   the tail from E.track.lo, the first row touched, once rows have been
+   inserted or removed (reshaped). */
+void editorTrackTouch(erow* row){
+  if (row->gen <= E.track.savegen) row->disksize = row->size;
+  row->gen = ++E.track.gen;
+  if (row->idx < E.track.lo) E.track.lo = row->idx;
+}
+
+/* rows were inserted or removed at at */
+void editorTrackReshape(int at){
+  E.track.reshaped = 1;
+  if (at < E.track.lo) E.track.lo = at;
+}
+
+void editorTrackInsert(erow* row){
+  row->gen = ++E.track.gen;
+  row->disksize = -1;
+  editorTrackReshape(row->idx);
+}
+
+/* 1 when the file is still the one last read or written */
+int editorTrackUnchanged(void){
+  struct stat st;
+  return stat(E.filename, &st) == 0 && st.st_size == E.track.size &&
+         st.st_mtim.tv_sec == E.track.mtime.tv_sec &&
+         st.st_mtim.tv_nsec == E.track.mtime.tv_nsec;
+}
+
+/* the rows now match the file, exact says whether byte for byte */
+void editorTrackBaseline(int exact){
+  struct stat st;
+  E.track.savegen = E.track.gen;
+  E.track.lo = E.numrows;
+  E.track.reshaped = 0;
+  E.track.exact = exact && stat(E.filename, &st) == 0;
+  if (E.track.exact){
+    E.track.size = st.st_size;
+    E.track.mtime = st.st_mtim;
+  }
+}
+
+/* after a load: CRLF line ends or a missing final newline make it inexact */
+void editorTrackLoaded(void){
+  long long total = 0;
+  for (int i = 0; i < E.numrows; i++) total += E.rows[i].size + 1;
+  int exact = 0;
+  int fd = open(E.filename, O_RDONLY);
+  if (fd != -1){
+    struct stat st;
+    char last = '\n';
+    exact = fstat(fd, &st) == 0 && st.st_size == total &&
+            (total == 0 || (pread(fd, &last, 1, total - 1) == 1 && last == '\n'));
+    close(fd);
+  }
+  editorTrackBaseline(exact);
+}
+
+/* file i/o  */
+
+void editorOpen(char *filename)
+{
+  size_t namelen = strlen(filename);
+  if (namelen > 3 && !strcmp(filename + namelen - 3, ".gz")){
+    editorOpenGzip(filename);
+    return;
+  }
+  if (editorIsBinary(filename)){
+    editorOpenHex(filename);
+    return;
+  }
+  free(E.filename);
+  E.filename = strdup(filename);
+  editorSelectSyntaxHighlight();
+  if (E.cache.enabled && editorCacheLoad(filename)){
+    E.dirty = 0;
+    editorTrackLoaded();
+    E.journal.enabled = 1;
+    if (!E.attach.holding) editorJournalRecover();
+    return;
+  }
+  FILE *fp = fopen(filename, "r");
+  if (!fp)
+    die("fopen");
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+
+  while ((linelen = getline(&line, &linecap, fp)) != -1)
+  {
+    while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+    {
+      linelen--;
+    }
+    editorInsertRow(E.numrows, line, linelen);
+  }
+  free(line);
+  fclose(fp);
+  if (E.cache.enabled) editorCacheStore(filename);
+  E.dirty = 0;
+  editorTrackLoaded();
+  E.journal.enabled = 1;
+  if (!E.attach.holding) editorJournalRecover();
+}
+
+struct snapshotWriter
+{
+  int fd;
+  int progressfd;
+  long long total;
+  long long written;
+  long long reported;
+  int len;
+  char buf[1 << 16];
+};
+
+int snapshotFlush(struct snapshotWriter* w){
+  if (w->len > 0 && write(w->fd, w->buf, w->len) != w->len) return -1;
+  w->written += w->len;
+  w->len = 0;
+  if (w->progressfd == -1) return 0;
+  if (w->written - w->reported >= w->total / 100 || w->written == w->total){
+    if (write(w->progressfd, &w->written, sizeof(w->written)) == -1) return -1;
+    w->reported = w->written;
+  }
+  return 0;
+}
+
+int snapshotPut(struct snapshotWriter* w, const char* s, int len){
+  while (len > 0){
+    int n = sizeof(w->buf) - w->len;
+    if (n > len) n = len;
+    memcpy(&w->buf[w->len], s, n);
+    w->len += n;
+    s += n;
+    len -= n;
+    if (w->len == (int)sizeof(w->buf) && snapshotFlush(w) == -1) return -1;
+  }
+  return 0;
+}
+
+/* Runs in the forked child, whose rows are a copy-on-write snapshot of the
+   parent's, and writes rows from first on starting at byte from of a file
+   of total bytes. Returns 0 or the errno to exit with. */
+int editorWriteSnapshot(int progressfd, long long total, int first, long long from){
+  static struct snapshotWriter w;
+  w.progressfd = progressfd;
+  w.total = total - from;
+  w.fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+  if (w.fd == -1) return errno;
+  if (ftruncate(w.fd, total) == -1) return errno;
+  if (lseek(w.fd, from, SEEK_SET) == -1) return errno;
+
+  for (int i = first; i < E.numrows; i++){
+    if (snapshotPut(&w, E.rows[i].chars, E.rows[i].size) == -1 ||
+        snapshotPut(&w, "\n", 1) == -1)
+      return errno ? errno : EIO;
+  }
+  if (snapshotFlush(&w) == -1) return errno ? errno : EIO;
+  if (close(w.fd) == -1) return errno;
+  return 0;
+}
+
+/* rewrites the changed rows, which all kept their length, in place */
+int editorWritePatch(int progressfd){
+  int fd = open(E.filename, O_WRONLY);
+  if (fd == -1) return errno;
+  long long off = 0, written = 0;
+  for (int i = 0; i < E.numrows; i++){
+    erow* row = &E.rows[i];
+    if (row->gen > E.track.savegen){
+      if (pwrite(fd, row->chars, row->size, off) != row->size) return errno ? errno : EIO;
+      written += row->size;
+    }
+    off += row->size + 1;
+  }
+  if (write(progressfd, &written, sizeof(written)) == -1) return errno;
+  if (close(fd) == -1) return errno;
+  return 0;
+}
+
+/* bytes a save has to write, with first and from set for a snapshot and
+   first = -1 for a patch */
+long long editorSavePlan(int* first, long long* from){
+  long long total = 0, patch = 0;
+  int exact = E.track.exact && editorTrackUnchanged();
+  int fit = exact && !E.track.reshaped;
+  int lo = E.track.lo < E.numrows ? E.track.lo : E.numrows;
+  *first = 0;
+  *from = 0;
+  for (int i = 0; i < E.numrows; i++){
+    erow* row = &E.rows[i];
+    if (i < lo) *from += row->size + 1;
+    if (row->gen > E.track.savegen){
+      patch += row->size;
+      if (row->size != row->disksize) fit = 0;
+    }
+    total += row->size + 1;
+  }
+  if (fit){
+    *first = -1;
+    return patch;
+  }
+  if (exact) *first = lo;
+  else *from = 0;
+  return total;
+}
+
+void editorSave(void) {
+  if (E.save.pid > 0){
+    editorSetStatusMessage("Save already in progress");
+    return;
+  }
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s", NULL);
+    if (E.filename == NULL){
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+  editorGzipFinish();
+  editorJournalCompactCancel();
+  editorJournalFlush();
+  E.save.journaloff = (E.journal.fd == -1) ? -1 : lseek(E.journal.fd, 0, SEEK_END);
+  /* the rebase drops the yank records before journaloff, so a paste made
+     while the save runs must write the clipboard out again */
+  E.clip.journaled = 0;
+
+  int fds[2];
+  if (pipe(fds) == -1){
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    return;
+  }
+  int first;
+  long long from;
+  long long total = editorSavePlan(&first, &from);
+
+  pid_t pid = fork();
+  if (pid == -1){
+    close(fds[0]);
+    close(fds[1]);
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    return;
+  }
+  if (pid == 0){
+    close(fds[0]);
+    _exit(first < 0 ? editorWritePatch(fds[1]) : editorWriteSnapshot(fds[1], total, first, from));
+  }
+  close(fds[1]);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  E.save.pid = pid;
+  E.save.progressfd = fds[0];
+  E.save.total = first < 0 ? total : total - from;
+  E.save.written = 0;
+  E.save.dirty = E.dirty;
+  E.save.gen = E.track.gen;
+  editorJobStart(JOB_SAVE, 0);
+}
+
+/* Follows the save's progress until the child exits. Edits made while the
+   save was running stay counted in E.dirty. */
+int editorSaveJob(int* redraw){
+  if (E.save.pid <= 0) return JOB_DONE;
+  long long written;
+  while (read(E.save.progressfd, &written, sizeof(written)) == sizeof(written)){
+    E.save.written = written;
+    *redraw = 1;
+  }
+  int status;
+  if (waitpid(E.save.pid, &status, WNOHANG) != E.save.pid) return JOB_FRAME_MS;
+
+  close(E.save.progressfd);
+  E.save.pid = 0;
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0){
+    E.dirty -= E.save.dirty;
+    if (E.dirty < 0) E.dirty = 0;
+    E.journal.enabled = 1;
+    editorJournalRebase(E.save.journaloff);
+    /* rows edited during the save may have stale disk sizes */
+    editorTrackBaseline(E.track.gen == E.save.gen);
+    E.track.savegen = E.save.gen;
+    editorSetStatusMessage("%lld bytes written to disk", E.save.total);
+  } else {
+    E.track.exact = 0;
+    int err = WIFEXITED(status) ? WEXITSTATUS(status) : EINTR;
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(err));
+  }
+  *redraw = 1;
+  return JOB_DONE;
+}
+
+/* syntax highlighting */
+
+/* Classifies every byte once per syntax so the highlighter does a table
+   lookup instead of isspace/strchr/strncmp at each position. */
+void editorSyntaxBuildClasses(struct EditorSyntax* syn, struct EditorClasses* cc){
+  unsigned char* cls = cc->cclass;
+  memset(cls, 0, 256);
+  for (int c = 0; c < 256; c++){
+    if (isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c))
+      cls[c] |= CC_SEP;
+    else
+      cls[c] |= CC_WORD;
+    if ((syn->flags & HL_HIGHLIGHT_NUMBERS) && isdigit(c))
+      cls[c] |= CC_DIGIT;
+  }
+  if (syn->flags & HL_HIGHLIGHT_STRINGS){
+    cls['"'] |= CC_QUOTE;
+    cls['\''] |= CC_QUOTE;
+  }
+  if (syn->singleline_comment_start && syn->singleline_comment_start[0])
+    cls[(unsigned char)syn->singleline_comment_start[0]] |= CC_COMMENT;
+  if (syn->multiline_comment_start && syn->multiline_comment_start[0] &&
+      syn->multiline_comment_end && syn->multiline_comment_end[0])
+    cls[(unsigned char)syn->multiline_comment_start[0]] |= CC_COMMENT;
+  for (int j = 0; syn->keywords[j]; j++)
+    cls[(unsigned char)syn->keywords[j][0]] |= CC_KEYWORD;
+
+  /* the vector scan knows letters, digits and '_' and compares up to four
+     other bytes, anything else falls back to the table */
+  cc->vscan = 1;
+  cc->nopen = 0;
+  for (int c = 0; c < 256; c++){
+    if (isalnum(c) || c == '_') continue;
+    if (cls[c] & CC_OPEN){
+      if (cc->nopen < 4) cc->open[cc->nopen++] = c;
+      else cc->vscan = 0;
+    } else if (cls[c] & (CC_DIGIT | CC_KEYWORD)){
+      cc->vscan = 0;
+    }
+  }
+  cc->ready = 1;
+}
+
+/* first byte that might start a string, comment, number or keyword */
+int hlFindCandidate(const unsigned char* s, int len, const struct EditorClasses* syn){
+  int i = 0;
+#if defined(__SSE2__)
+  if (syn->vscan){
+    const __m128i lower = _mm_set1_epi8(0x20);
+    const __m128i a = _mm_set1_epi8('a'), az = _mm_set1_epi8('z' - 'a');
+    const __m128i d = _mm_set1_epi8('0'), d9 = _mm_set1_epi8(9);
+    const __m128i us = _mm_set1_epi8('_');
+    for (; i + 16 <= len; i += 16){
+      __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+      __m128i l = _mm_sub_epi8(_mm_or_si128(v, lower), a);
+      __m128i n = _mm_sub_epi8(v, d);
+      __m128i m = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(l, az), l),
+                               _mm_cmpeq_epi8(_mm_min_epu8(n, d9), n));
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(v, us));
+      for (int k = 0; k < syn->nopen; k++)
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8((char)syn->open[k])));
+      int bits = _mm_movemask_epi8(m);
+      if (bits) return i + __builtin_ctz(bits);
+    }
+  }
+#endif
+  for (; i < len; i++){
+    if (syn->cclass[s[i]] & (CC_OPEN | CC_DIGIT | CC_KEYWORD)) return i;
+  }
+  return len;
+}
+
+/* Bytes from s that the normal state can pass over without emitting a
+   span: separators, and words that do not start a number or keyword.
+   *prev_sep is updated to the state after them. */
+int hlSkipPlain(const unsigned char* s, int len, const struct EditorClasses* syn, int* prev_sep){
+  const unsigned char* cls = syn->cclass;
+  int i = 0;
+  while (i < len){
+    int k = i + hlFindCandidate(s + i, len - i, syn);
+    if (k > i) *prev_sep = cls[s[k - 1]] & CC_SEP;
+    i = k;
+    if (i == len) break;
+    if ((cls[s[i]] & CC_OPEN) || (*prev_sep && (cls[s[i]] & (CC_DIGIT | CC_KEYWORD))))
+      break;
+    while (i < len && (cls[s[i]] & CC_WORD) && !(cls[s[i]] & CC_OPEN)) i++;
+    *prev_sep = 0;
+  }
+  return i;
+}
+
+/* Highlighting is stored as sorted, non-overlapping (start, len, class)
+   spans over the render buffer, anything not covered is HL_NORMAL. */
+hlspan* hl_scratch = NULL;
+int hl_scratch_len = 0;
+int hl_scratch_cap = 0;
+
+void hlPush(int start, int len, unsigned char hl){
+  if (len <= 0) return;
+  if (hl_scratch_len > 0){
+    hlspan* last = &hl_scratch[hl_scratch_len - 1];
+    if (last->hl == hl && last->start + last->len == start){
+      last->len += len;
+      return;
+    }
+  }
+  if (hl_scratch_len == hl_scratch_cap){
+    hl_scratch_cap = hl_scratch_cap ? hl_scratch_cap * 2 : 16;
+    hl_scratch = memRealloc(MEM_HL, hl_scratch, sizeof(hlspan) * hl_scratch_cap);
+  }
+  hl_scratch[hl_scratch_len].start = start;
+  hl_scratch[hl_scratch_len].len = len;
+  hl_scratch[hl_scratch_len].hl = hl;
+  hl_scratch_len++;
+}
+
+unsigned char hlPrevClass(int at){
+  if (hl_scratch_len == 0) return HL_NORMAL;
+  hlspan* last = &hl_scratch[hl_scratch_len - 1];
+  return (last->start + last->len == at) ? last->hl : HL_NORMAL;
+}
+
+void hlCommit(erow* row){
+  memFree(row->hl);
+  row->hl = NULL;
+  row->hlsize = hl_scratch_len;
+  if (hl_scratch_len){
+    row->hl = memAlloc(MEM_HL, sizeof(hlspan) * hl_scratch_len);
+    memcpy(row->hl, hl_scratch, sizeof(hlspan) * hl_scratch_len);
+  }
+}
+
+/* overlays [start, start + len) with class hl, splitting the spans it cuts */
+void editorRowSetSpan(erow* row, int start, int len, unsigned char hl){
+  int end = start + len;
+  int placed = 0;
+  int n = 0;
+  hlspan* out = memAlloc(MEM_HL, sizeof(hlspan) * (row->hlsize + 2));
+  hlspan span = { start, len, hl };
+
+  for (int k = 0; k < row->hlsize; k++){
+    hlspan sp = row->hl[k];
+    int spend = sp.start + sp.len;
+    if (spend <= start){
+      out[n++] = sp;
+      continue;
+    }
+    if (!placed && sp.start >= end){
+      out[n++] = span;
+      placed = 1;
+    }
+    if (sp.start >= end){
+      out[n++] = sp;
+      continue;
+    }
+    if (sp.start < start){
+      out[n] = sp;
+      out[n++].len = start - sp.start;
+    }
+    if (!placed){
+      out[n++] = span;
+      placed = 1;
+    }
+    if (spend > end){
+      out[n] = sp;
+      out[n].start = end;
+      out[n++].len = spend - end;
+    }
+  }
+  if (!placed) out[n++] = span;
+  memFree(row->hl);
+  row->hl = out;
+  row->hlsize = n;
+}
+
+/* highlights one row, returns whether the comment state it leaves for
+   the next row changed */
+int editorHighlightRow(erow* row){
+  hl_scratch_len = 0;
+
+  if (E.syntax == NULL){
+    hlCommit(row);
+    return 0;
+  }
+
+  char **keywords = E.syntax->keywords;
+  const unsigned char* cls = E.classes->cclass;
+
+  char* scs = E.syntax->singleline_comment_start;
+  char* mcs = E.syntax->multiline_comment_start;
+  char* mce = E.syntax->multiline_comment_end;
+
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+
+  int prev_sep = 1;
+  int in_string = 0;
+  int in_comment = (row->idx > 0 && E.rows[row->idx - 1].hl_open_comment);
+
+  int i = 0;
+  while (i < row->rsize){
+    if (!in_string && !in_comment && hlPrevClass(i) != HL_NUMBER){
+      i += hlSkipPlain((unsigned char*)&row->render[i], row->rsize - i, E.classes, &prev_sep);
+      if (i >= row->rsize) break;
+    }
+    char c = row->render[i];
+    unsigned char cc = cls[(unsigned char)c];
+    unsigned char prev_hl = hlPrevClass(i);
+
+    if (scs_len && !in_string && !in_comment && (cc & CC_COMMENT)){
+      if(!strncmp(&row->render[i], scs, scs_len)){
+        hlPush(i, row->rsize - i, HL_COMMENT);
+        break;
+      }
+    }
+
+    if (mcs_len && mce_len && !in_string){
+      if (in_comment){
+        if (c == mce[0] && !strncmp(&row->render[i], mce, mce_len)){
+          hlPush(i, mce_len, HL_MLCOMMENT);
+          i += mce_len;
+          in_comment = 0;
+          prev_sep = 1;
+          continue;
+        }
+        char* next = memchr(&row->render[i + 1], mce[0], row->rsize - i - 1);
+        int end = next ? next - row->render : row->rsize;
+        hlPush(i, end - i, HL_MLCOMMENT);
+        i = end;
+        continue;
+      } else if ((cc & CC_COMMENT) && !strncmp(&row->render[i], mcs, mcs_len)){
+          hlPush(i, mcs_len, HL_MLCOMMENT);
+          i += mcs_len;
+          in_comment = 1;
+          continue;
+        }
+    }
+
+    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS){
+      if (in_string) {
+        if (c == '\\' && i + 1 < row->rsize){
+          hlPush(i, 2, HL_STRING);
+          i += 2;
+          continue;
+        }
+        if (c == in_string){
+          hlPush(i, 1, HL_STRING);
+          in_string = 0;
+          i++;
+          prev_sep = 1;
+          continue;
+        }
+        int end = i + 1;
+        while (end < row->rsize && row->render[end] != in_string && row->render[end] != '\\')
+          end++;
+        hlPush(i, end - i, HL_STRING);
+        i = end;
         prev_sep = 1;
         continue;
       }
       else {
-        if (c == '"' || c =='\'') {
+        if (cc & CC_QUOTE) {
           in_string = c;
-          row->hl[i] = HL_STRING;
+          hlPush(i, 1, HL_STRING);
           i++;
           continue;
         }
       }
     }
     if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS){
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)){
-        row->hl[i] = HL_NUMBER;
+      if (((cc & CC_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)){
+        hlPush(i, 1, HL_NUMBER);
         i++;
         prev_sep = 0;
         continue;
       }
     }
 
-    if (prev_sep){
+    if (prev_sep && (cc & CC_KEYWORD)){
       int j;
       for (j = 0; keywords[j]; j++){
+        if (keywords[j][0] != c) continue;
         int klen = strlen(keywords[j]);
         int kw2 = keywords[j][klen-1] == '|';
         if (kw2) klen--;
 
         if(!strncmp(&row->render[i], keywords[j], klen) &&
-           is_separator(row->render[i + klen])){
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+           (cls[(unsigned char)row->render[i + klen]] & CC_SEP)){
+          hlPush(i, klen, kw2 ? HL_KEYWORD2 : HL_KEYWORD1);
           i += klen;
           break;
         }
@@ -479,13 +1909,73 @@ void editorUpdateSyntax(erow* row){
         }
     }
 
-    prev_sep = is_separator(c);
+    prev_sep = cc & CC_SEP;
     i++;
   }
+  hlCommit(row);
   int changed = (row->hl_open_comment != in_comment);
   row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows){
-    editorUpdateSyntax(&E.rows[row->idx + 1]);
+  return changed;
+}
+
+/* Rows from E.hlfrom on may have been highlighted under a comment state
+   that has since changed: the highlight job carries the state down from
+   there for as long as it keeps changing and at least through E.hlto.
+   Rows are brought up to date before they are drawn or searched. */
+
+#define HL_SLICE 1024
+
+void editorHighlightDefer(int at){
+  if (E.hlfrom < 0) E.hlfrom = E.hlto = at;
+  if (at < E.hlfrom) E.hlfrom = at;
+  if (at > E.hlto) E.hlto = at;
+  editorJobStart(JOB_HIGHLIGHT, 0);
+}
+
+/* keeps the pending rows in place when n rows are inserted at at, or -n
+   removed */
+void editorHighlightShift(int at, int n){
+  if (E.hlfrom < 0) return;
+  if (at <= E.hlfrom) E.hlfrom = E.hlfrom + n > at ? E.hlfrom + n : at;
+  if (at <= E.hlto) E.hlto = E.hlto + n > at ? E.hlto + n : at;
+}
+
+/* highlights up to n pending rows, returns 0 once none are left */
+int editorHighlightStep(int n){
+  while (E.hlfrom >= 0 && n-- > 0){
+    if (E.hlfrom >= E.numrows){
+      E.hlfrom = -1;
+      break;
+    }
+    erow* row = &E.rows[E.hlfrom++];
+    if (row->stale) editorRenderRow(row);
+    if (!editorHighlightRow(row) && E.hlfrom > E.hlto) E.hlfrom = -1;
+  }
+  return E.hlfrom >= 0;
+}
+
+void editorHighlightThrough(int at){
+  while (E.hlfrom >= 0 && E.hlfrom <= at) editorHighlightStep(HL_SLICE);
+}
+
+int editorHighlightJob(int* redraw){
+  (void)redraw;
+  return editorHighlightStep(HL_SLICE) ? 0 : JOB_DONE;
+}
+
+/* highlights row and the rows after it for as long as the comment state
+   handed down keeps changing, leaving what lies past the screen to the
+   highlight job */
+void editorUpdateSyntax(erow* row){
+  int limit = editorScreenLimit();
+  if (row->stale) editorRenderRow(row);
+  while (editorHighlightRow(row) && row->idx + 1 < E.numrows){
+    if (row->idx >= limit){
+      editorHighlightDefer(row->idx + 1);
+      return;
+    }
+    row = &E.rows[row->idx + 1];
+    if (row->stale) editorRenderRow(row);
   }
 }
 
@@ -515,9 +2005,13 @@ void editorSelectSyntaxHighlight(void){
       if ((is_ext && ext && !strcmp(ext, s->filematch[j])) ||
           (!is_ext && strstr(E.filename, s->filematch[j]))){
         E.syntax = s;
+        E.classes = &HLCLASSES[i];
+        if (!E.classes->ready) editorSyntaxBuildClasses(s, E.classes);
         for (int filerow = 0; filerow < E.numrows; filerow++){
-          editorUpdateSyntax(&E.rows[filerow]);
+          if (E.rows[filerow].stale) editorRenderRow(&E.rows[filerow]);
+          editorHighlightRow(&E.rows[filerow]);
         }
+        E.hlfrom = -1;
         return;
       }
       j++;
@@ -526,16 +2020,429 @@ void editorSelectSyntaxHighlight(void){
 }
 
 
+/* unicode */
+
+struct utf8Range {
+  int lo;
+  int hi;
+};
+
+struct utf8Range utf8_zero_width[] = {
+  { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD },
+  { 0x0610, 0x061A }, { 0x064B, 0x065F }, { 0x0E31, 0x0E31 },
+  { 0x0E34, 0x0E3A }, { 0x0E47, 0x0E4E }, { 0x1AB0, 0x1AFF },
+  { 0x1DC0, 0x1DFF }, { 0x200B, 0x200F }, { 0x20D0, 0x20FF },
+  { 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F }, { 0xFEFF, 0xFEFF },
+};
+
+struct utf8Range utf8_wide[] = {
+  { 0x1100, 0x115F }, { 0x2E80, 0x303E }, { 0x3041, 0x33FF },
+  { 0x3400, 0x4DBF }, { 0x4E00, 0x9FFF }, { 0xA000, 0xA4CF },
+  { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAFF }, { 0xFE30, 0xFE4F },
+  { 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 }, { 0x1F300, 0x1F64F },
+  { 0x1F900, 0x1F9FF }, { 0x20000, 0x2FFFD }, { 0x30000, 0x3FFFD },
+};
+
+int utf8InRanges(int cp, struct utf8Range* ranges, int n){
+  int lo = 0, hi = n - 1;
+  while (lo <= hi){
+    int mid = (lo + hi) / 2;
+    if (cp < ranges[mid].lo) hi = mid - 1;
+    else if (cp > ranges[mid].hi) lo = mid + 1;
+    else return 1;
+  }
+  return 0;
+}
+
+/* invalid bytes have cp = -1 and are displayed as a single '?' */
+int utf8Width(int cp){
+  if (cp < 0) return 1;
+  if (utf8InRanges(cp, utf8_zero_width, sizeof(utf8_zero_width) / sizeof(utf8_zero_width[0])))
+    return 0;
+  if (utf8InRanges(cp, utf8_wide, sizeof(utf8_wide) / sizeof(utf8_wide[0])))
+    return 2;
+  return 1;
+}
+
+/* returns the length of the sequence at s, malformed input decodes as one
+   byte with cp = -1 */
+int utf8Decode(const char* s, int len, int* cp){
+  unsigned char c = s[0];
+  int n, min;
+  if (c < 0x80){
+    *cp = c;
+    return 1;
+  } else if ((c & 0xE0) == 0xC0){
+    n = 2; min = 0x80; *cp = c & 0x1F;
+  } else if ((c & 0xF0) == 0xE0){
+    n = 3; min = 0x800; *cp = c & 0x0F;
+  } else if ((c & 0xF8) == 0xF0){
+    n = 4; min = 0x10000; *cp = c & 0x07;
+  } else {
+    *cp = -1;
+    return 1;
+  }
+  if (n > len){
+    *cp = -1;
+    return 1;
+  }
+  for (int i = 1; i < n; i++){
+    unsigned char cc = s[i];
+    if ((cc & 0xC0) != 0x80){
+      *cp = -1;
+      return 1;
+    }
+    *cp = (*cp << 6) | (cc & 0x3F);
+  }
+  if (*cp < min || *cp > 0x10FFFF || (*cp >= 0xD800 && *cp <= 0xDFFF)){
+    *cp = -1;
+    return 1;
+  }
+  return n;
+}
+
+/* rows are almost always plain ASCII, so check 16 bytes at a time and skip
+   the decoding paths entirely when no byte has its high bit set */
+int isAsciiRun(const char* s, int len){
+  int i = 0;
+#if defined(__SSE2__)
+  for (; i + 16 <= len; i += 16){
+    __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+    if (_mm_movemask_epi8(v)) return 0;
+  }
+#endif
+  for (; i + 8 <= len; i += 8){
+    uint64_t w;
+    memcpy(&w, s + i, 8);
+    if (w & 0x8080808080808080ULL) return 0;
+  }
+  for (; i < len; i++){
+    if ((unsigned char)s[i] & 0x80) return 0;
+  }
+  return 1;
+}
+
+/* identifier index */
+
+/* Every identifier maps to the rows using it. Rows are referred to by a
+   stable uid rather than their position, and E.index.uidrow translates a
+   uid to the current position. Row inserts and deletes shift positions
+   without reordering rows, so each posting list stays sorted and can be
+   binary searched.
+
+   Words are split by isIdentChar rather than the highlighter's classes,
+   which depend on the syntax and do not exist for plain files; bytes of
+   UTF-8 sequences count as part of a word. */
+
+int isIdentChar(int c){
+  c = (unsigned char)c;
+  return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+unsigned int identHash(const char* s, int len){
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < len; i++){
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+void identGrow(void){
+  int cap = E.index.cap ? E.index.cap * 2 : 1024;
+  ident** table = memCalloc(MEM_INDEX, cap, sizeof(ident*));
+  for (int i = 0; i < E.index.cap; i++){
+    ident* id = E.index.table[i];
+    while (id){
+      ident* next = id->next;
+      id->next = table[id->hash & (cap - 1)];
+      table[id->hash & (cap - 1)] = id;
+      id = next;
+    }
+  }
+  memFree(E.index.table);
+  E.index.table = table;
+  E.index.cap = cap;
+}
+
+ident* identLookup(const char* s, int len, int create){
+  unsigned int h = identHash(s, len);
+  if (E.index.cap){
+    for (ident* id = E.index.table[h & (E.index.cap - 1)]; id; id = id->next){
+      if (id->hash == h && id->len == len && !memcmp(id->name, s, len)) return id;
+    }
+  }
+  if (!create) return NULL;
+  if (E.index.count >= E.index.cap) identGrow();
+
+  ident* id = memCalloc(MEM_INDEX, 1, sizeof(ident));
+  id->name = memAlloc(MEM_INDEX, len + 1);
+  memcpy(id->name, s, len);
+  id->name[len] = '\0';
+  id->len = len;
+  id->hash = h;
+  id->stamp = -1;
+  id->next = E.index.table[h & (E.index.cap - 1)];
+  E.index.table[h & (E.index.cap - 1)] = id;
+  E.index.count++;
+  return id;
+}
+
+void identRemove(ident* id){
+  ident** link = &E.index.table[id->hash & (E.index.cap - 1)];
+  while (*link != id) link = &(*link)->next;
+  *link = id->next;
+  E.index.count--;
+  memFree(id->rows);
+  memFree(id->name);
+  memFree(id);
+}
+
+/* first posting of id at or after file row at */
+int identRowPos(ident* id, int at){
+  int lo = 0, hi = id->nrows;
+  while (lo < hi){
+    int mid = (lo + hi) / 2;
+    if (E.index.uidrow[id->rows[mid]] < at) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+int editorAllocUid(void){
+  if (E.index.nfree) return E.index.freeuids[--E.index.nfree];
+  if (E.index.nextuid == E.index.uidcap){
+    E.index.uidcap = E.index.uidcap ? E.index.uidcap * 2 : 1024;
+    E.index.uidrow = memRealloc(MEM_INDEX, E.index.uidrow, sizeof(int) * E.index.uidcap);
+  }
+  return E.index.nextuid++;
+}
+
+void editorFreeUid(int uid){
+  if (E.index.nfree == E.index.freecap){
+    E.index.freecap = E.index.freecap ? E.index.freecap * 2 : 1024;
+    E.index.freeuids = memRealloc(MEM_INDEX, E.index.freeuids, sizeof(int) * E.index.freecap);
+  }
+  E.index.freeuids[E.index.nfree++] = uid;
+}
+
+/* removes the posting for row, and id with it once nothing uses it */
+void identDropRow(ident* id, erow* row){
+  int pos = identRowPos(id, row->idx);
+  if (pos < id->nrows && id->rows[pos] == row->uid){
+    memmove(&id->rows[pos], &id->rows[pos + 1], sizeof(int) * (id->nrows - pos - 1));
+    id->nrows--;
+  }
+  if (id->nrows == 0 && id->pins == 0) identRemove(id);
+}
+
+void editorUnindexRow(erow* row){
+  for (int k = 0; k < row->nidents; k++){
+    row->idents[k].id->total -= row->idents[k].count;
+    identDropRow(row->idents[k].id, row);
+  }
+  memFree(row->idents);
+  row->idents = NULL;
+  row->nidents = 0;
+}
+
+/* adds a posting for row, which id must not have yet */
+void identAddRow(ident* id, erow* row){
+  if (id->nrows == id->caprows){
+    id->caprows = id->caprows ? id->caprows * 2 : 4;
+    id->rows = memRealloc(MEM_INDEX, id->rows, sizeof(int) * id->caprows);
+  }
+  int pos = identRowPos(id, row->idx);
+  memmove(&id->rows[pos + 1], &id->rows[pos], sizeof(int) * (id->nrows - pos));
+  id->rows[pos] = row->uid;
+  id->nrows++;
+}
+
+/* Re-indexes a row after its text changed. Only identifiers that appear
+   or disappear touch posting lists, an edit inside a word moves two at
+   most and one that keeps the words none. */
+void editorIndexRow(erow* row){
+  struct rowIdent* old = row->idents;
+  int nold = row->nidents;
+  int was = ++E.index.stamp;
+  for (int k = 0; k < nold; k++){
+    old[k].id->stamp = was;
+    old[k].id->slot = k;
+  }
+
+  int stamp = ++E.index.stamp;
+  int cap = 0;
+  int i = 0;
+  row->idents = NULL;
+  row->nidents = 0;
+  while (i < row->size){
+    if (!isIdentChar(row->chars[i])){
+      i++;
+      continue;
+    }
+    int start = i;
+    while (i < row->size && isIdentChar(row->chars[i])) i++;
+    if (isdigit((unsigned char)row->chars[start])) continue;
+
+    ident* id = identLookup(&row->chars[start], i - start, 1);
+    id->total++;
+    if (id->stamp == stamp){
+      row->idents[id->slot].count++;
+      continue;
+    }
+    if (id->stamp == was) id->total -= old[id->slot].count;
+    else identAddRow(id, row);
+    if (row->nidents == cap){
+      cap = cap ? cap * 2 : 8;
+      row->idents = memRealloc(MEM_INDEX, row->idents, sizeof(struct rowIdent) * cap);
+    }
+    id->stamp = stamp;
+    id->slot = row->nidents;
+    row->idents[row->nidents].id = id;
+    row->idents[row->nidents].count = 1;
+    row->nidents++;
+  }
+
+  /* identifiers the row no longer has */
+  for (int k = 0; k < nold; k++){
+    if (old[k].id->stamp != was) continue;
+    old[k].id->total -= old[k].count;
+    identDropRow(old[k].id, row);
+  }
+  memFree(old);
+}
+
+/* Bulk versions for a block of rows [at, at + n). A block occupies one
+   contiguous run of every posting list it appears in, so each identifier
+   is moved once instead of once per row. */
+
+/* collects the distinct identifiers of the block, counting their rows in
+   slot and adding delta * count to their totals */
+ident** editorBlockIdents(int at, int n, int delta, int* count){
+  int stamp = ++E.index.stamp;
+  int cap = 16;
+  ident** list = memAlloc(MEM_INDEX, sizeof(ident*) * cap);
+  *count = 0;
+  for (int j = at; j < at + n; j++){
+    erow* row = &E.rows[j];
+    for (int k = 0; k < row->nidents; k++){
+      ident* id = row->idents[k].id;
+      id->total += delta * row->idents[k].count;
+      if (id->stamp != stamp){
+        if (*count == cap){
+          cap *= 2;
+          list = memRealloc(MEM_INDEX, list, sizeof(ident*) * cap);
+        }
+        list[(*count)++] = id;
+        id->stamp = stamp;
+        id->slot = 0;
+      }
+      id->slot++;
+    }
+  }
+  return list;
+}
+
+/* writes the uids of the block in row order, starting at each
+   identifier's slot */
+void editorPostRows(int at, int n){
+  for (int j = at; j < at + n; j++){
+    erow* row = &E.rows[j];
+    for (int k = 0; k < row->nidents; k++){
+      ident* id = row->idents[k].id;
+      id->rows[id->slot++] = row->uid;
+    }
+  }
+}
+
+/* adds postings for rows whose idents are already set */
+void editorIndexRows(int at, int n){
+  int count;
+  ident** list = editorBlockIdents(at, n, 1, &count);
+  for (int i = 0; i < count; i++){
+    ident* id = list[i];
+    int pending = id->slot;
+    if (id->nrows + pending > id->caprows){
+      id->caprows = (id->nrows + pending) * 2;
+      id->rows = memRealloc(MEM_INDEX, id->rows, sizeof(int) * id->caprows);
+    }
+    int pos = identRowPos(id, at);
+    memmove(&id->rows[pos + pending], &id->rows[pos], sizeof(int) * (id->nrows - pos));
+    id->nrows += pending;
+    id->slot = pos;
+  }
+  editorPostRows(at, n);
+  memFree(list);
+}
+
+/* For a block whose rows were reordered in place the postings are already
+   in the right place per identifier, only their order within it changes. */
+void editorRepostRows(int at, int n){
+  int count;
+  ident** list = editorBlockIdents(at, n, 0, &count);
+  for (int i = 0; i < count; i++) list[i]->slot = identRowPos(list[i], at);
+  editorPostRows(at, n);
+  memFree(list);
+}
+
+void editorUnindexRows(int at, int n){
+  int count;
+  ident** list = editorBlockIdents(at, n, -1, &count);
+  for (int i = 0; i < count; i++){
+    ident* id = list[i];
+    int lo = identRowPos(id, at);
+    int hi = identRowPos(id, at + n);
+    memmove(&id->rows[lo], &id->rows[hi], sizeof(int) * (id->nrows - hi));
+    id->nrows -= hi - lo;
+  }
+  for (int j = at; j < at + n; j++){
+    memFree(E.rows[j].idents);
+    E.rows[j].idents = NULL;
+    E.rows[j].nidents = 0;
+  }
+  for (int i = 0; i < count; i++){
+    if (list[i]->nrows == 0 && list[i]->pins == 0) identRemove(list[i]);
+  }
+  memFree(list);
+}
+
+/* The clipboard pins the identifiers its rows refer to, so they outlive
+   their last row in the buffer. */
+void identPin(struct rowIdent* idents, int n, int delta){
+  for (int k = 0; k < n; k++){
+    ident* id = idents[k].id;
+    id->pins += delta;
+    if (id->pins == 0 && id->nrows == 0) identRemove(id);
+  }
+}
+
 /* Row operations */
 
 int editorRowRxtoCx(erow* row, int rx){
   int cur_rx = 0;
   int cx;
+  if (!row->ascii){
+    cx = 0;
+    while (cx < row->size){
+      int cp, width;
+      int n = 1;
+      if (row->chars[cx] == '\t'){
+        width = TAB_STOP - (cur_rx % TAB_STOP);
+      } else {
+        n = utf8Decode(&row->chars[cx], row->size - cx, &cp);
+        width = utf8Width(cp);
+      }
+      if (cur_rx + width > rx) return cx;
+      cur_rx += width;
+      cx += n;
+    }
+    return cx;
+  }
   for (cx = 0; cx < row->size; cx++){
     if (row->chars[cx] == '\t'){
-      cur_rx += (TAB_STOP - 1) - (rx % TAB_STOP);
+      cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
     }
-    rx++;
+    cur_rx++;
     if (cur_rx > rx) return cx;
   }
   return cx;
@@ -544,23 +2451,358 @@ int editorRowRxtoCx(erow* row, int rx){
 int editorRowCxtoRx(erow* row, int cx){
   int rx = 0;
   int j;
+  if (!row->ascii){
+    j = 0;
+    while (j < cx && j < row->size){
+      if (row->chars[j] == '\t'){
+        rx += TAB_STOP - (rx % TAB_STOP);
+        j++;
+      } else {
+        int cp;
+        j += utf8Decode(&row->chars[j], row->size - j, &cp);
+        rx += utf8Width(cp);
+      }
+    }
+    return rx;
+  }
   for (j= 0; j < cx; j++){
     if (row->chars[j] == '\t'){
       rx += (TAB_STOP - 1) - (rx % TAB_STOP);
     }
     rx++;
   }
-  return rx;
-}
+  return rx;
+}
+
+int editorRowRenderToRx(erow* row, int idx){
+  return row->rcol ? row->rcol[idx] : idx;
+}
+
+/* first render byte drawn at or after column rx */
+int editorRowRxToRender(erow* row, int rx){
+  if (!row->rcol) return rx < row->rsize ? rx : row->rsize;
+  int lo = 0, hi = row->rsize;
+  while (lo < hi){
+    int mid = (lo + hi) / 2;
+    if (row->rcol[mid] < rx) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+int editorRowNextChar(erow* row, int cx){
+  if (cx >= row->size) return row->size;
+  if (row->ascii) return cx + 1;
+  int cp;
+  cx += utf8Decode(&row->chars[cx], row->size - cx, &cp);
+  while (cx < row->size){
+    int n = utf8Decode(&row->chars[cx], row->size - cx, &cp);
+    if (utf8Width(cp) != 0) break;
+    cx += n;
+  }
+  return cx;
+}
+
+int editorRowPrevChar(erow* row, int cx){
+  if (cx <= 0) return 0;
+  if (row->ascii) return cx - 1;
+  while (cx > 0){
+    int cp;
+    cx--;
+    while (cx > 0 && ((unsigned char)row->chars[cx] & 0xC0) == 0x80) cx--;
+    utf8Decode(&row->chars[cx], row->size - cx, &cp);
+    if (utf8Width(cp) != 0) break;
+  }
+  return cx;
+}
+
+/* soft wrap */
+
+/* A visual line ends before a character that does not fit in it, so a
+   double-width character never straddles the wrap column and the line
+   is left a column short. Returns the column of the line after the one
+   starting at column start. */
+int editorWrapNext(erow* row, int start){
+  int end = start + E.screencols;
+  if (row->rcol == NULL) return end;
+  int i = editorRowRxToRender(row, start);
+  while (i < row->rsize && row->rcol[i] < end){
+    int cp;
+    int n = utf8Decode(&row->render[i], row->rsize - i, &cp);
+    if (row->rcol[i] + utf8Width(cp) > end) return row->rcol[i] > start ? row->rcol[i] : end;
+    i += n;
+  }
+  return end;
+}
+
+/* index of the visual line of row holding column rx, *start is where it
+   begins */
+int editorWrapLine(erow* row, int rx, int* start){
+  if (row->stale) editorUpdateRow(row);
+  int sub = 0;
+  *start = 0;
+  if (row->rcol == NULL){
+    sub = rx / E.screencols;
+    *start = sub * E.screencols;
+    return sub;
+  }
+  for (int next; (next = editorWrapNext(row, *start)) <= rx; sub++) *start = next;
+  return sub;
+}
+
+int editorWrapLineStart(erow* row, int sub){
+  if (row->stale) editorUpdateRow(row);
+  int start = 0;
+  while (sub-- > 0) start = editorWrapNext(row, start);
+  return start;
+}
+
+int editorRowWrapHeight(erow* row){
+  int start;
+  if (E.screencols <= 0) return 1;
+  return editorWrapLine(row, row->rwidth, &start) + 1;
+}
+
+/* E.wraptree is a Fenwick tree over the wrapped height of every row, so
+   mapping between file rows and visual lines costs O(log n). A change of
+   width is a point update. Inserting or deleting rows moves the rows
+   after it, so only the nodes above E.wrapfrom, the first row moved, are
+   recomputed, on the next sync: appending a row costs O(log n). The tree
+   is rebuilt whole when the screen width changes. */
+
+/* rows from at on have moved */
+void editorWrapShift(int at){
+  if (at < E.wrapfrom) E.wrapfrom = at;
+}
+
+int editorWrapValid(void){
+  return E.wrapcols == E.screencols && E.wrapfrom == INT_MAX;
+}
+
+void editorWrapRebuild(void){
+  int n = E.numrows;
+  E.wraptree = memRealloc(MEM_WRAP, E.wraptree, sizeof(int) * (n + 1));
+  E.wraptree[0] = 0;
+  for (int i = 1; i <= n; i++){
+    E.rows[i - 1].wrapheight = editorRowWrapHeight(&E.rows[i - 1]);
+    E.wraptree[i] = E.rows[i - 1].wrapheight;
+  }
+  for (int i = 1; i <= n; i++){
+    int parent = i + (i & -i);
+    if (parent <= n) E.wraptree[parent] += E.wraptree[i];
+  }
+  E.wrapsize = n;
+  E.wrapcols = E.screencols;
+  E.wrapfrom = INT_MAX;
+}
+
+/* Nodes up to E.wrapfrom only cover rows before it and are kept. A node
+   above it is its row plus its children, i - 1, i - 2, i - 4 and so on
+   below i's lowest bit, which are done by the time it is reached. */
+void editorWrapRepair(void){
+  int n = E.numrows;
+  int from = E.wrapfrom < E.wrapsize ? E.wrapfrom : E.wrapsize;
+  E.wraptree = memRealloc(MEM_WRAP, E.wraptree, sizeof(int) * (n + 1));
+  for (int i = from + 1; i <= n; i++){
+    E.rows[i - 1].wrapheight = editorRowWrapHeight(&E.rows[i - 1]);
+    E.wraptree[i] = E.rows[i - 1].wrapheight;
+    for (int k = 1; k < (i & -i); k <<= 1) E.wraptree[i] += E.wraptree[i - k];
+  }
+  E.wrapsize = n;
+  E.wrapfrom = INT_MAX;
+}
+
+void editorWrapSync(void){
+  if (E.wrapcols != E.screencols) editorWrapRebuild();
+  else if (E.wrapfrom != INT_MAX) editorWrapRepair();
+}
+
+void editorWrapUpdateRow(erow* row){
+  if (!E.softwrap || E.wrapcols != E.screencols) return;
+  int height = editorRowWrapHeight(row);
+  int delta = height - row->wrapheight;
+  row->wrapheight = height;
+  /* nodes past E.wrapfrom are recomputed anyway */
+  if (delta == 0 || row->idx >= E.wrapfrom) return;
+  for (int i = row->idx + 1; i <= E.wrapsize; i += i & -i){
+    E.wraptree[i] += delta;
+  }
+}
+
+int editorWrapPrefix(int filerow){
+  int sum = 0;
+  if (filerow > E.wrapsize) filerow = E.wrapsize;
+  for (int i = filerow; i > 0; i -= i & -i){
+    sum += E.wraptree[i];
+  }
+  return sum;
+}
+
+/* returns the file row holding visual line vline and stores the line's
+   index inside that row in sub, past the last row it returns E.numrows */
+int editorWrapRowAt(int vline, int* sub){
+  int pos = 0;
+  int step = 1;
+  while (step * 2 <= E.wrapsize) step *= 2;
+  for (; step > 0; step >>= 1){
+    if (pos + step <= E.wrapsize && E.wraptree[pos + step] <= vline){
+      pos += step;
+      vline -= E.wraptree[pos];
+    }
+  }
+  *sub = vline;
+  return pos;
+}
+
+/* a file row at or past the last one the screen shows, also once the
+   cursor has been scrolled into view */
+int editorScreenLimit(void){
+  int bottom = E.rowoff + E.screenrows;
+  if (E.softwrap && editorWrapValid()){
+    int sub;
+    bottom = editorWrapRowAt(E.rowoff + E.screenrows, &sub);
+  }
+  return bottom > E.cy + E.screenrows ? bottom : E.cy + E.screenrows;
+}
+
+/* the cursor's visual line, *col is its column in it */
+int editorWrapCursorLine(int rx, int* col){
+  int start;
+  *col = 0;
+  if (E.cy >= E.numrows) return editorWrapPrefix(E.numrows) + (E.cy - E.numrows);
+  int sub = editorWrapLine(&E.rows[E.cy], rx, &start);
+  *col = rx - start;
+  return editorWrapPrefix(E.cy) + sub;
+}
+
+void editorWrapMoveTo(int vline, int col){
+  int sub;
+  E.cy = editorWrapRowAt(vline, &sub);
+  if (E.cy >= E.numrows){
+    E.cy = E.numrows;
+    E.cx = 0;
+    return;
+  }
+  erow* row = &E.rows[E.cy];
+  int start = editorWrapLineStart(row, sub);
+  int next = editorWrapNext(row, start);
+  /* stay on the line when it was left short */
+  if (start + col >= next) col = next - start - 1;
+  E.cx = editorRowRxtoCx(row, start + col);
+}
+
+void editorWrapMoveCursor(int key){
+  editorWrapSync();
+  int rx = (E.cy < E.numrows) ? editorRowCxtoRx(&E.rows[E.cy], E.cx) : 0;
+  int col;
+  int vline = editorWrapCursorLine(rx, &col);
+  if (key == ARROW_UP){
+    if (vline == 0) return;
+    vline--;
+  } else {
+    if (vline >= editorWrapPrefix(E.numrows)) return;
+    vline++;
+  }
+  editorWrapMoveTo(vline, col);
+}
+
+void editorToggleSoftWrap(void){
+  int sub;
+  editorWrapSync();
+  if (E.softwrap){
+    E.rowoff = editorWrapRowAt(E.rowoff, &sub);
+    E.softwrap = 0;
+  } else {
+    E.softwrap = 1;
+    editorWrapRebuild();
+    E.rowoff = editorWrapPrefix(E.rowoff);
+    E.coloff = 0;
+  }
+  editorSetStatusMessage("Soft wrap %s", E.softwrap ? "on" : "off");
+}
+
+/* the gutter takes its columns from the text area */
+void editorToggleGutter(void){
+  int sub;
+  if (E.softwrap){
+    editorWrapSync();
+    E.rowoff = editorWrapRowAt(E.rowoff, &sub);
+  }
+  E.gutter = E.gutter ? 0 : 2;
+  E.screencols += E.gutter ? -2 : 2;
+  E.frame.valid = 0;
+  if (E.softwrap){
+    editorWrapSync();
+    E.rowoff = editorWrapPrefix(E.rowoff);
+  }
+  editorSetStatusMessage("Gutter %s", E.gutter ? "on" : "off");
+}
+
+void editorUpdateRowUnicode(erow* row){
+  int tabs = 0;
+  int j;
+  for (j = 0; j < row->size; j++){
+    if (row->chars[j] == '\t') tabs++;
+  }
+  int cap = row->size + tabs*(TAB_STOP - 1) + 1;
+  memFree(row->render);
+  row->render = memAlloc(MEM_RENDER, cap);
+  row->rcol = memRealloc(MEM_RENDER, row->rcol, sizeof(int) * cap);
+
+  int idx = 0;
+  int col = 0;
+  int charcol = 0;
+  j = 0;
+  while (j < row->size){
+    if (row->chars[j] == '\t'){
+      do {
+        row->rcol[idx] = col++;
+        row->render[idx++] = ' ';
+      } while (col % TAB_STOP != 0);
+      charcol = col - 1;
+      j++;
+      continue;
+    }
+    int cp;
+    int n = utf8Decode(&row->chars[j], row->size - j, &cp);
+    int width = utf8Width(cp);
+    if (width > 0) charcol = col;
+    for (int k = 0; k < n; k++){
+      row->rcol[idx] = charcol;
+      row->render[idx++] = (cp < 0) ? '?' : row->chars[j + k];
+    }
+    col += width;
+    j += n;
+  }
+  row->rcol[idx] = col;
+  row->render[idx] = '\0';
+  row->rsize = idx;
+  row->rwidth = col;
+}
+
+/* everything but highlighting, which depends on the rows above */
+void editorRenderRow(erow* row){
+  if (row->stale){
+    row->stale = 0;
+    E.cache.stale--;
+  }
+  editorIndexRow(row);
+  row->ascii = isAsciiRun(row->chars, row->size);
+  if (!row->ascii){
+    editorUpdateRowUnicode(row);
+    editorWrapUpdateRow(row);
+    return;
+  }
+  memFree(row->rcol);
+  row->rcol = NULL;
 
-void editorUpdateRow(erow* row){
   int tabs = 0;
   int j;
   for (j = 0; j < row->size; j++){
     if (row->chars[j] == '\t') tabs++;
   }
-  free(row->render);
-  row->render = malloc(row->size + tabs*(TAB_STOP - 1) + 1);
+  memFree(row->render);
+  row->render = memAlloc(MEM_RENDER, row->size + tabs*(TAB_STOP - 1) + 1);
   int idx = 0;
   for (j = 0; j < row->size; j++){
     if (row->chars[j] == '\t'){
@@ -572,119 +2814,1209 @@ void editorUpdateRow(erow* row){
   }
   row->render[idx] = '\0';
   row->rsize = idx;
-	editorUpdateSyntax(row);
+  row->rwidth = idx;
+  editorWrapUpdateRow(row);
+}
+
+void editorUpdateRow(erow* row){
+  editorRenderRow(row);
+  editorUpdateSyntax(row);
 }
 
 
 void editorInsertRow(int at, char *s, size_t len)
 {
   if (at < 0 || at > E.numrows) return;
+  editorWrapShift(at);
 
-  E.rows = realloc(E.rows, sizeof(erow) * (E.numrows + 1));
+  editorHighlightShift(at, 1);
+  E.rows = memRealloc(MEM_ROWS, E.rows, sizeof(erow) * (E.numrows + 1));
   memmove(&E.rows[at + 1], &E.rows[at], sizeof(erow) * (E.numrows - at));
-  for (int j = at + 1; j <= E.numrows; j++) E.rows[j].idx++;
+  for (int j = at + 1; j <= E.numrows; j++){
+    E.rows[j].idx++;
+    E.index.uidrow[E.rows[j].uid] = j;
+  }
 
   E.rows[at].idx = at;
+  E.rows[at].uid = editorAllocUid();
+  E.index.uidrow[E.rows[at].uid] = at;
+  E.rows[at].idents = NULL;
+  E.rows[at].nidents = 0;
+  E.rows[at].stale = 0;
 
   E.rows[at].size = len;
-  E.rows[at].chars = malloc(len + 1);
+  E.rows[at].chars = memAlloc(MEM_CHARS, len + 1);
   memcpy(E.rows[at].chars, s, len);
   E.rows[at].chars[len] = '\0';
 
   E.rows[at].rsize = 0;
   E.rows[at].render = NULL;
+  E.rows[at].rcol = NULL;
   E.rows[at].hl = NULL;
+  E.rows[at].hlsize = 0;
   E.rows[at].hl_open_comment = 0;
+  editorTrackInsert(&E.rows[at]);
   editorUpdateRow(&E.rows[at]);
 
   E.numrows++;
   E.dirty++;
+  editorJournalRecord(J_INSROW, at, 0, s, len);
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+  if (at < 0 || at > row->size) at = row->size;
+  editorTrackTouch(row);
+  row->chars = memRealloc(MEM_CHARS, row->chars, row->size + 2);
+  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+  row->size++;
+  row->chars[at] = c;
+  editorUpdateRow(row);
+  E.dirty++;
+  char ch = c;
+  editorJournalRecord(J_INSCHAR, row->idx, at, &ch, 1);
+}
+
+/* deletes n bytes at at, the journal record carries them */
+void editorRowDelChars(erow *row, int at, int n){
+  if (at < 0 || n <= 0 || at + n > row->size) return;
+  editorTrackTouch(row);
+  editorJournalRecord(J_DELCHAR, row->idx, at, &row->chars[at], n);
+  row->chars = memUnshare(row->chars);
+  memmove(&row->chars[at], &row->chars[at + n], row->size - at - n + 1);
+  row->size -= n;
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+void editorFreeRow(erow* row){
+  if (row->uid == E.mark) E.mark = -1;
+  if (row->stale) E.cache.stale--;
+  editorUnindexRow(row);
+  editorFreeUid(row->uid);
+  memFree(row->render);
+  memFree(row->rcol);
+  memFree(row->chars);
+  memFree(row->hl);
+}
+
+void editorDelRow(int at){
+  if (at < 0 || at >= E.numrows) return;
+  editorWrapShift(at);
+  editorFreeRow(&E.rows[at]);
+  memmove(&E.rows[at], &E.rows[at + 1], sizeof(erow) * (E.numrows - at - 1));
+  editorTrackReshape(at);
+  editorHighlightShift(at, -1);
+  for (int j = at; j < E.numrows - 1; j++){
+    E.rows[j].idx--;
+    E.index.uidrow[E.rows[j].uid] = j;
+  }
+  E.numrows--;
+  E.dirty++;
+  editorJournalRecord(J_DELROW, at, 0, NULL, 0);
+}
+
+/* Inserts copies of n rows that share their text, render and highlight
+   buffers with src, so the cost is per row rather than per byte. src was
+   highlighted below a row whose hl_open_comment was open_comment. */
+void editorInsertRows(int at, erow* src, int n, int open_comment){
+  if (at < 0 || at > E.numrows || n <= 0) return;
+  editorWrapShift(at);
+  editorHighlightShift(at, n);
+  E.rows = memRealloc(MEM_ROWS, E.rows, sizeof(erow) * (E.numrows + n));
+  memmove(&E.rows[at + n], &E.rows[at], sizeof(erow) * (E.numrows - at));
+  E.numrows += n;
+  for (int j = at + n; j < E.numrows; j++){
+    E.rows[j].idx = j;
+    E.index.uidrow[E.rows[j].uid] = j;
+  }
+  for (int i = 0; i < n; i++){
+    erow* row = &E.rows[at + i];
+    *row = src[i];
+    row->idx = at + i;
+    row->chars = memShare(src[i].chars);
+    row->render = memShare(src[i].render);
+    row->rcol = memShare(src[i].rcol);
+    row->hl = memShare(src[i].hl);
+    row->idents = memShare(src[i].idents);
+    if (row->stale) E.cache.stale++;
+    row->uid = editorAllocUid();
+    E.index.uidrow[row->uid] = at + i;
+    editorTrackInsert(row);
+  }
+  editorIndexRows(at, n);
+  if (E.cache.stale) editorJobStart(JOB_STALE, 0);
+  E.dirty++;
+
+  int above = at > 0 ? E.rows[at - 1].hl_open_comment : 0;
+  if (E.syntax && above != open_comment)
+    editorUpdateSyntax(&E.rows[at]);
+  if (E.syntax && at + n < E.numrows && E.rows[at + n - 1].hl_open_comment != above)
+    editorUpdateSyntax(&E.rows[at + n]);
+}
+
+/* frees a block of rows, leaving highlighting and the journal to the
+   caller */
+void editorRemoveRows(int at, int n){
+  editorWrapShift(at);
+  editorTrackReshape(at);
+  editorHighlightShift(at, -n);
+  editorUnindexRows(at, n);
+  for (int j = at; j < at + n; j++) editorFreeRow(&E.rows[j]);
+  memmove(&E.rows[at], &E.rows[at + n], sizeof(erow) * (E.numrows - at - n));
+  E.numrows -= n;
+  for (int j = at; j < E.numrows; j++){
+    E.rows[j].idx = j;
+    E.index.uidrow[E.rows[j].uid] = j;
+  }
+}
+
+void editorDelRows(int at, int n){
+  if (at < 0 || n <= 0 || at + n > E.numrows) return;
+  int below = E.rows[at + n - 1].hl_open_comment;
+  editorRemoveRows(at, n);
+  E.dirty++;
+  editorJournalRecord(J_DELROWS, at, n, NULL, 0);
+
+  int above = at > 0 ? E.rows[at - 1].hl_open_comment : 0;
+  if (E.syntax && at < E.numrows && above != below)
+    editorUpdateSyntax(&E.rows[at]);
+}
+
+void editorRowAppendString(erow* row, char* s, size_t len){
+  editorTrackTouch(row);
+  row->chars = memRealloc(MEM_CHARS, row->chars, row->size + len + 1);
+  memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
+  E.dirty++;
+  editorJournalRecord(J_APPEND, row->idx, 0, s, len);
+}
+
+void editorRowTruncate(erow* row, int len){
+  if (len < 0 || len > row->size) return;
+  editorTrackTouch(row);
+  row->chars = memUnshare(row->chars);
+  row->size = len;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
+  E.dirty++;
+  editorJournalRecord(J_TRUNC, row->idx, len, NULL, 0);
+}
+
+/* line cache */
+
+/* With -c, opening a file leaves a sidecar .<name>.ctc holding the length
+   of every line and the highlighter's open-comment state after it, keyed
+   by the file's size, mtime and a hash of its contents. When the cache
+   matches, rows are cut out of a mapping of the file by those lengths and
+   left stale: a stale row already knows where a block comment stands, so
+   it can be rendered, highlighted and indexed on its own, which happens
+   when it is drawn or edited and otherwise while the editor is idle. */
+
+#define CACHE_MAGIC "CTC1"
+#define CACHE_HEADER_SIZE 48
+#define STALE_SLICE 1024
+
+char* editorCachePath(const char* filename){
+  const char* base = strrchr(filename, '/');
+  int dirlen = base ? base - filename + 1 : 0;
+  base = base ? base + 1 : filename;
+  char* path = memAlloc(MEM_CACHE, dirlen + strlen(base) + 6);
+  sprintf(path, "%.*s.%s.ctc", dirlen, filename, base);
+  return path;
+}
+
+uint64_t editorCacheHash(const unsigned char* p, size_t n){
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ n;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8){
+    uint64_t w;
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdull;
+    h ^= h >> 32;
+  }
+  for (; i < n; i++) h = (h ^ p[i]) * 0x100000001b3ull;
+  return h;
+}
+
+/* size, mtime and highlighter the cache is valid for */
+void editorCacheKey(char* header, struct stat* st, uint64_t hash, int64_t numrows){
+  int32_t syntax = E.syntax ? (int32_t)(E.syntax - HLDB) : -1;
+  int64_t key[3] = { st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec };
+  memcpy(header, CACHE_MAGIC, 4);
+  memcpy(&header[4], &syntax, 4);
+  memcpy(&header[8], key, sizeof(key));
+  memcpy(&header[32], &hash, 8);
+  memcpy(&header[40], &numrows, 8);
+}
+
+/* reads a LEB128 length, returns the bytes used or 0 when truncated */
+int editorCacheVarint(const unsigned char* p, const unsigned char* end, uint64_t* v){
+  *v = 0;
+  for (int i = 0; p + i < end && i < 10; i++){
+    *v |= (uint64_t)(p[i] & 127) << (7 * i);
+    if (!(p[i] & 128)) return i + 1;
+  }
+  return 0;
+}
+
+/* appends a row to be rendered, highlighted and indexed when first needed */
+void editorAppendStaleRow(const char* s, size_t len, int open_comment){
+  erow* row = &E.rows[E.numrows];
+  memset(row, 0, sizeof(*row));
+  row->idx = E.numrows;
+  row->uid = editorAllocUid();
+  E.index.uidrow[row->uid] = row->idx;
+  row->size = len;
+  row->chars = memAlloc(MEM_CHARS, len + 1);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  row->hl_open_comment = open_comment;
+  row->wrapheight = 1;
+  row->stale = 1;
+  E.cache.stale++;
+  E.numrows++;
+}
+
+/* loads the rows of filename from its cache, returns 0 when there is no
+   valid cache and nothing was loaded */
+int editorCacheLoad(const char* filename){
+  char* path = editorCachePath(filename);
+  int cfd = open(path, O_RDONLY);
+  memFree(path);
+  int fd = open(filename, O_RDONLY);
+  struct stat st, cst;
+  unsigned char* cache = NULL;
+  unsigned char* map = MAP_FAILED;
+  int loaded = 0;
+  if (cfd == -1 || fd == -1 || fstat(fd, &st) == -1 || fstat(cfd, &cst) == -1 ||
+      st.st_size == 0 || cst.st_size < CACHE_HEADER_SIZE)
+    goto done;
+
+  cache = memAlloc(MEM_CACHE, cst.st_size);
+  if (read(cfd, cache, cst.st_size) != cst.st_size) goto done;
+  int64_t numrows;
+  memcpy(&numrows, &cache[40], 8);
+  char header[CACHE_HEADER_SIZE];
+  editorCacheKey(header, &st, 0, numrows);
+  if (memcmp(cache, header, 32) != 0 || numrows <= 0 || numrows >= INT_MAX ||
+      cst.st_size < CACHE_HEADER_SIZE + (numrows + 7) / 8)
+    goto done;
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) goto done;
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  uint64_t hash;
+  memcpy(&hash, &cache[32], 8);
+  if (editorCacheHash(map, st.st_size) != hash) goto done;
+
+  /* the lengths must add up to the file before any row is built */
+  const unsigned char* bits = cache + CACHE_HEADER_SIZE;
+  const unsigned char* lens = bits + (numrows + 7) / 8;
+  const unsigned char* end = cache + cst.st_size;
+  const unsigned char* p = lens;
+  uint64_t total = 0, len;
+  for (int64_t j = 0; j < numrows; j++){
+    int n = editorCacheVarint(p, end, &len);
+    if (n == 0 || len == 0 || len > (uint64_t)st.st_size) goto done;
+    p += n;
+    total += len;
+  }
+  if (total != (uint64_t)st.st_size || p != end) goto done;
+
+  E.rows = memRealloc(MEM_ROWS, E.rows, sizeof(erow) * (E.numrows + numrows));
+  off_t off = 0;
+  p = lens;
+  for (int64_t j = 0; j < numrows; j++){
+    p += editorCacheVarint(p, end, &len);
+    const char* s = (const char*)map + off;
+    off += len;
+    while (len > 0 && (s[len - 1] == '\n' || s[len - 1] == '\r')) len--;
+    editorAppendStaleRow(s, len, (bits[j / 8] >> (j % 8)) & 1);
+  }
+  loaded = 1;
+  editorJobStart(JOB_STALE, 0);
+
+done:
+  if (map != MAP_FAILED) munmap(map, st.st_size);
+  memFree(cache);
+  if (cfd != -1) close(cfd);
+  if (fd != -1) close(fd);
+  return loaded;
+}
+
+/* writes the cache for filename, whose lines are all loaded and fresh */
+void editorCacheStore(const char* filename){
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0){
+    if (fd != -1) close(fd);
+    return;
+  }
+  unsigned char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return;
+
+  struct abuff ab = ABUFF_INIT;
+  ab.tag = MEM_CACHE;
+  char header[CACHE_HEADER_SIZE];
+  editorCacheKey(header, &st, editorCacheHash(map, st.st_size), E.numrows);
+  abAppend(&ab, header, sizeof(header));
+  int nbits = (E.numrows + 7) / 8;
+  unsigned char* bits = memCalloc(MEM_CACHE, nbits ? nbits : 1, 1);
+  for (int j = 0; j < E.numrows; j++)
+    if (E.rows[j].hl_open_comment) bits[j / 8] |= 1 << (j % 8);
+  abAppend(&ab, (char*)bits, nbits);
+  memFree(bits);
+
+  int64_t rows = 0;
+  off_t off = 0;
+  while (off < st.st_size){
+    unsigned char* nl = memchr(map + off, '\n', st.st_size - off);
+    uint64_t len = nl ? (uint64_t)(nl - (map + off) + 1) : (uint64_t)(st.st_size - off);
+    unsigned char buf[10];
+    int n = 0;
+    do {
+      buf[n++] = (len & 127) | (len > 127 ? 128 : 0);
+      len >>= 7;
+    } while (len);
+    abAppend(&ab, (char*)buf, n);
+    off = nl ? nl - map + 1 : st.st_size;
+    rows++;
+  }
+  munmap(map, st.st_size);
+
+  char* path = editorCachePath(filename);
+  char* tmp = memAlloc(MEM_CACHE, strlen(path) + 8);
+  sprintf(tmp, "%s.XXXXXX", path);
+  int tfd = rows == E.numrows ? mkstemp(tmp) : -1;
+  if (tfd != -1){
+    int ok = write(tfd, ab.b, ab.len) == ab.len;
+    close(tfd);
+    if (!ok || rename(tmp, path) == -1) unlink(tmp);
+  }
+  memFree(tmp);
+  memFree(path);
+  abFree(&ab);
+}
+
+/* brings up to n stale rows up to date, returns 0 once none are left */
+int editorStaleStep(int n){
+  while (n-- > 0 && E.cache.stale > 0){
+    if (E.cache.next >= E.numrows) E.cache.next = 0;
+    erow* row = &E.rows[E.cache.next++];
+    if (row->stale) editorUpdateRow(row);
+  }
+  return E.cache.stale > 0;
+}
+
+int editorStaleJob(int* redraw){
+  (void)redraw;
+  return editorStaleStep(STALE_SLICE) ? 0 : JOB_DONE;
+}
+
+/* for what needs every row indexed */
+void editorStaleFinish(void){
+  while (editorStaleStep(STALE_SLICE));
+}
+
+/* editor operations */
+
+void editorInsertChar(int c){
+  if (E.cy == E.numrows){
+    editorInsertRow(E.numrows, "", 0);
+  }
+  editorRowInsertChar(&E.rows[E.cy], E.cx, c);
+  E.cx++;
+}
+
+void editorInsertNewLine(void){
+  if (E.cx == 0) {
+    editorInsertRow(E.cy, "", 0);
+  }
+  else {
+    erow* row = &E.rows[E.cy];
+    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    editorRowTruncate(&E.rows[E.cy], E.cx);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+void editorDelChar(void){
+  if (E.cy == E.numrows) return;
+  if (E.cy == 0 && E.cx == 0) return;
+  erow* row = &E.rows[E.cy];
+  if (E.cx > 0){
+    int start = editorRowPrevChar(row, E.cx);
+    editorRowDelChars(row, start, E.cx - start);
+    E.cx = start;
+  }
+  else {
+    E.cx = E.rows[E.cy - 1].size;
+    editorRowAppendString(&E.rows[E.cy - 1], row->chars, row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+}
+
+/* clipboard */
+
+/* The clipboard holds rows whose buffers, highlighting and identifier
+   lists are shared with the rows they were yanked from. Either side copies
+   a buffer only when it edits it, so yank and paste cost per row, not per
+   byte. */
+
+void editorClipClear(void){
+  for (int i = 0; i < E.clip.numrows; i++){
+    erow* row = &E.clip.rows[i];
+    memFree(row->chars);
+    memFree(row->render);
+    memFree(row->rcol);
+    memFree(row->hl);
+    identPin(row->idents, row->nidents, -1);
+    memFree(row->idents);
+  }
+  memFree(E.clip.rows);
+  E.clip.rows = NULL;
+  E.clip.numrows = 0;
+}
+
+void editorYankRows(int at, int n){
+  if (at < 0 || n <= 0 || at + n > E.numrows) return;
+  editorClipClear();
+  E.clip.rows = memAlloc(MEM_CLIP, sizeof(erow) * n);
+  for (int i = 0; i < n; i++){
+    erow* row = &E.clip.rows[i];
+    *row = E.rows[at + i];
+    row->chars = memShare(row->chars);
+    row->render = memShare(row->render);
+    row->rcol = memShare(row->rcol);
+    row->hl = memShare(row->hl);
+    row->idents = memShare(row->idents);
+    identPin(row->idents, row->nidents, 1);
+    row->uid = -1;
+  }
+  E.clip.numrows = n;
+  E.clip.open_comment = at > 0 ? E.rows[at - 1].hl_open_comment : 0;
+  E.clip.journaled = 1;
+  editorJournalRecord(J_YANK, at, n, NULL, 0);
+}
+
+/* A paste is journaled as a reference to the yank before it. If that
+   yank is not in the journal (it predates the last save), the clipboard
+   text is written once. */
+void editorJournalClip(void){
+  if (E.clip.journaled || !E.journal.enabled || E.journal.replaying) return;
+  struct abuff ab = ABUFF_INIT;
+  ab.tag = MEM_JOURNAL;
+  for (int i = 0; i < E.clip.numrows; i++){
+    abAppend(&ab, E.clip.rows[i].chars, E.clip.rows[i].size);
+    abAppend(&ab, "\n", 1);
+  }
+  editorJournalRecord(J_CLIP, E.clip.numrows, 0, ab.b, ab.len);
+  abFree(&ab);
+  E.clip.journaled = 1;
+}
+
+void editorPasteRows(int at){
+  if (E.clip.numrows == 0) return;
+  editorJournalClip();
+  editorInsertRows(at, E.clip.rows, E.clip.numrows, E.clip.open_comment);
+  editorJournalRecord(J_PASTE, at, 0, NULL, 0);
+}
+
+/* rows between the mark and the cursor, or the cursor row */
+int editorSelection(int* first, int* last){
+  int cy = E.cy < E.numrows ? E.cy : E.numrows - 1;
+  *first = *last = cy;
+  if (E.mark >= 0){
+    int markrow = E.index.uidrow[E.mark];
+    if (markrow < *first) *first = markrow;
+    if (markrow > *last) *last = markrow;
+  }
+  return cy >= 0;
+}
+
+void editorToggleMark(void){
+  if (E.mark >= 0 || E.cy >= E.numrows){
+    E.mark = -1;
+    editorSetStatusMessage("Mark cleared");
+    return;
+  }
+  E.mark = E.rows[E.cy].uid;
+  editorSetStatusMessage("Mark set, Ctrl-C copies / Ctrl-K cuts the lines up to the cursor");
+}
+
+void editorCopy(int cut){
+  int first, last;
+  if (!editorSelection(&first, &last)) return;
+  int n = last - first + 1;
+  editorYankRows(first, n);
+  E.mark = -1;
+  if (cut){
+    editorDelRows(first, n);
+    E.cy = first;
+    E.cx = 0;
+  }
+  editorSetStatusMessage("%s %d line%s", cut ? "Cut" : "Copied", n, n == 1 ? "" : "s");
+}
+
+void editorPaste(void){
+  if (E.clip.numrows == 0){
+    editorSetStatusMessage("Clipboard is empty");
+    return;
+  }
+  int n = E.clip.numrows;
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  editorPasteRows(E.cy);
+  E.cy += n;
+  E.cx = 0;
+  editorSetStatusMessage("Pasted %d line%s", n, n == 1 ? "" : "s");
+}
+
+/* bulk line operations */
+
+/* Ctrl-O runs a command over the selected lines, or over all of them:
+   sort, sort -r, uniq, keep TEXT or drop TEXT. A command only decides the
+   new order of the block as a list of row offsets. The rows are then moved
+   once, their postings rewritten in place, the rows left out removed as
+   one block and the rest highlighted in a single pass. Large sorts are
+   split over forked workers sorting slices of a shared mapping, which the
+   parent merges. */
+
+#define BULK_PARALLEL_MIN (1 << 15)
+#define BULK_MAX_WORKERS 8
+
+int bulk_first = 0;
+int bulk_reverse = 0;
+
+int bulkCompare(int a, int b){
+  erow* x = &E.rows[bulk_first + a];
+  erow* y = &E.rows[bulk_first + b];
+  int c = memcmp(x->chars, y->chars, x->size < y->size ? x->size : y->size);
+  if (c == 0) c = (x->size > y->size) - (x->size < y->size);
+  return bulk_reverse ? -c : c;
+}
+
+/* stable: on ties the element from a comes first */
+void bulkMerge(const int* a, int na, const int* b, int nb, int* out){
+  int i = 0, j = 0, k = 0;
+  while (i < na && j < nb) out[k++] = bulkCompare(b[j], a[i]) < 0 ? b[j++] : a[i++];
+  while (i < na) out[k++] = a[i++];
+  while (j < nb) out[k++] = b[j++];
+}
+
+void bulkMergeSort(int* v, int* tmp, int n){
+  if (n <= 16){
+    for (int i = 1; i < n; i++){
+      int x = v[i], j = i;
+      while (j > 0 && bulkCompare(x, v[j - 1]) < 0){
+        v[j] = v[j - 1];
+        j--;
+      }
+      v[j] = x;
+    }
+    return;
+  }
+  int half = n / 2;
+  bulkMergeSort(v, tmp, half);
+  bulkMergeSort(v + half, tmp + half, n - half);
+  if (bulkCompare(v[half], v[half - 1]) >= 0) return;
+  memcpy(tmp, v, sizeof(int) * n);
+  bulkMerge(tmp, half, tmp + half, n - half, v);
+}
+
+void bulkSort(int* v, int n){
+  int* tmp = memAlloc(MEM_ROWS, sizeof(int) * (n ? n : 1));
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers > BULK_MAX_WORKERS) workers = BULK_MAX_WORKERS;
+  int* shared = MAP_FAILED;
+  if (n >= BULK_PARALLEL_MIN && workers > 1)
+    shared = mmap(NULL, sizeof(int) * n, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED){
+    bulkMergeSort(v, tmp, n);
+    memFree(tmp);
+    return;
+  }
+
+  memcpy(shared, v, sizeof(int) * n);
+  int bounds[BULK_MAX_WORKERS + 1];
+  pid_t pids[BULK_MAX_WORKERS];
+  for (int w = 0; w <= workers; w++) bounds[w] = (long long)n * w / workers;
+  for (int w = 0; w < workers; w++){
+    pids[w] = fork();
+    if (pids[w] == 0){
+      bulkMergeSort(shared + bounds[w], tmp + bounds[w], bounds[w + 1] - bounds[w]);
+      _exit(0);
+    }
+  }
+  /* a slice whose worker could not run is sorted here */
+  for (int w = 0; w < workers; w++){
+    int status = 0;
+    if (pids[w] > 0) waitpid(pids[w], &status, 0);
+    if (pids[w] <= 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      bulkMergeSort(shared + bounds[w], tmp + bounds[w], bounds[w + 1] - bounds[w]);
+  }
+
+  int* src = shared;
+  int* dst = tmp;
+  for (int width = 1; width < workers; width *= 2){
+    for (int w = 0; w < workers; w += 2 * width){
+      int mid = bounds[w + width < workers ? w + width : workers];
+      int hi = bounds[w + 2 * width < workers ? w + 2 * width : workers];
+      bulkMerge(src + bounds[w], mid - bounds[w], src + mid, hi - mid, dst + bounds[w]);
+    }
+    int* t = src;
+    src = dst;
+    dst = t;
+  }
+  memcpy(v, src, sizeof(int) * n);
+  munmap(shared, sizeof(int) * n);
+  memFree(tmp);
+}
+
+/* keeps the first of every set of equal rows, returns the count kept */
+int bulkUnique(int* keep, int n){
+  int cap = 16;
+  while (cap < 2 * n) cap *= 2;
+  int* table = memAlloc(MEM_ROWS, sizeof(int) * cap);
+  uint32_t* hashes = memAlloc(MEM_ROWS, sizeof(uint32_t) * cap);
+  for (int i = 0; i < cap; i++) table[i] = -1;
+  int m = 0;
+  for (int i = 0; i < n; i++){
+    erow* row = &E.rows[bulk_first + i];
+    uint32_t h = editorCacheHash((unsigned char*)row->chars, row->size);
+    int slot = h & (cap - 1);
+    int dup = 0;
+    while (table[slot] != -1){
+      erow* other = &E.rows[bulk_first + table[slot]];
+      if (hashes[slot] == h && other->size == row->size &&
+          memcmp(other->chars, row->chars, row->size) == 0){
+        dup = 1;
+        break;
+      }
+      slot = (slot + 1) & (cap - 1);
+    }
+    if (dup) continue;
+    table[slot] = i;
+    hashes[slot] = h;
+    keep[m++] = i;
+  }
+  memFree(table);
+  memFree(hashes);
+  return m;
+}
+
+int bulkFilter(int* keep, int n, const char* text, int matching){
+  int len = strlen(text);
+  int m = 0;
+  for (int i = 0; i < n; i++){
+    erow* row = &E.rows[bulk_first + i];
+    if ((memmem(row->chars, row->size, text, len) != NULL) == matching) keep[m++] = i;
+  }
+  return m;
+}
+
+/* reorders the block [first, first + n) to the offsets in keep[0..m) and
+   deletes the rows not listed */
+void editorBulkApply(int first, int n, int* keep, int m){
+  editorHighlightThrough(first + n - 1);
+  int below = E.rows[first + n - 1].hl_open_comment;
+  erow* old = memAlloc(MEM_ROWS, sizeof(erow) * n);
+  char* kept = memCalloc(MEM_ROWS, n, 1);
+  memcpy(old, &E.rows[first], sizeof(erow) * n);
+  int j = first;
+  for (int i = 0; i < m; i++){
+    E.rows[j++] = old[keep[i]];
+    kept[keep[i]] = 1;
+  }
+  for (int i = 0; i < n; i++){
+    if (!kept[i]) E.rows[j++] = old[i];
+  }
+  for (j = first; j < first + n; j++){
+    E.rows[j].idx = j;
+    E.index.uidrow[E.rows[j].uid] = j;
+  }
+  int moved = 0;
+  for (int i = 0; i < m; i++){
+    if (keep[i] == i) continue;
+    editorTrackTouch(&E.rows[first + i]);
+    moved = 1;
+  }
+  if (moved) editorTrackReshape(first);
+  memFree(kept);
+  memFree(old);
+
+  editorRepostRows(first, n);
+  if (m < n) editorRemoveRows(first + m, n - m);
+  editorWrapShift(first);
+  E.dirty++;
+  if (E.syntax == NULL) return;
+  for (j = first; j < first + m; j++){
+    if (E.rows[j].stale) editorRenderRow(&E.rows[j]);
+    editorHighlightRow(&E.rows[j]);
+  }
+  int above = first + m > 0 ? E.rows[first + m - 1].hl_open_comment : 0;
+  if (first + m < E.numrows && above != below)
+    editorUpdateSyntax(&E.rows[first + m]);
+}
+
+/* runs cmd over n rows from first, returns the rows kept or -1 when cmd
+   is not a command */
+int editorBulkRun(int first, int n, const char* cmd){
+  int* keep = memAlloc(MEM_ROWS, sizeof(int) * n);
+  int m = n;
+  bulk_first = first;
+  if (!strcmp(cmd, "sort") || !strcmp(cmd, "sort -r")){
+    bulk_reverse = cmd[4] != '\0';
+    for (int i = 0; i < n; i++) keep[i] = i;
+    bulkSort(keep, n);
+  } else if (!strcmp(cmd, "uniq")){
+    m = bulkUnique(keep, n);
+  } else if (!strncmp(cmd, "keep ", 5) || !strncmp(cmd, "drop ", 5)){
+    m = bulkFilter(keep, n, cmd + 5, cmd[0] == 'k');
+  } else {
+    memFree(keep);
+    return -1;
+  }
+  editorBulkApply(first, n, keep, m);
+  memFree(keep);
+  editorJournalRecord(J_BULK, first, n, cmd, strlen(cmd));
+  return m;
+}
+
+void editorBulk(void){
+  if (E.numrows == 0) return;
+  int first = 0, last = E.numrows - 1;
+  if (E.mark >= 0) editorSelection(&first, &last);
+  char* cmd = editorPrompt("Lines: %s (sort, sort -r, uniq, keep TEXT, drop TEXT)", NULL);
+  if (cmd == NULL) return;
+  int n = last - first + 1;
+  int m = editorBulkRun(first, n, cmd);
+  if (m < 0){
+    editorSetStatusMessage("Unknown command: %s", cmd);
+  } else {
+    if (!strncmp(cmd, "sort", 4)) editorSetStatusMessage("Sorted %d lines", n);
+    else editorSetStatusMessage("Kept %d of %d lines", m, n);
+    E.mark = -1;
+    E.cy = first;
+    E.cx = 0;
+  }
+  free(cmd);
+}
+
+/* journal */
+
+/* Unsaved edits are appended to a sidecar journal as compact records, in
+   batches that each end with a J_COMMIT record. A crashed session is
+   recovered by replaying every complete batch on top of the file, as long
+   as the file still has the size and mtime stored in the journal header.
+   Once the records outgrow twice the text, the journal is compacted to a
+   single J_TEXT record holding all of it, which bounds both its size and
+   the work of a recovery.
+
+   The session writing a journal holds an flock on it until it exits, so
+   other sessions on the same file neither recover nor write it while that
+   session is alive. E.journal.fd is only open while the lock is held. */
+
+#define JOURNAL_MAGIC "CTJ2"
+#define JOURNAL_HEADER_SIZE 28
+#define JOURNAL_RECORD_SIZE 13
+
+char* editorJournalPath(const char* filename){
+  const char* base = strrchr(filename, '/');
+  int dirlen = base ? base - filename + 1 : 0;
+  base = base ? base + 1 : filename;
+  char* path = memAlloc(MEM_JOURNAL, dirlen + strlen(base) + 6);
+  sprintf(path, "%.*s.%s.ctj", dirlen, filename, base);
+  return path;
+}
+
+/* opens the journal and takes its lock, -1 if another session has it */
+int editorJournalLock(int flags){
+  if (E.journal.path == NULL) E.journal.path = editorJournalPath(E.filename);
+  int fd = open(E.journal.path, O_RDWR | O_CLOEXEC | flags, 0600);
+  if (fd == -1) return -1;
+  if (flock(fd, LOCK_EX | LOCK_NB) == -1){
+    if (errno == EWOULDBLOCK)
+      editorSetStatusMessage("%s is in use by another session, not journaling",
+                             E.journal.path);
+    close(fd);
+    E.journal.enabled = 0;
+    return -1;
+  }
+  E.journal.fd = fd;
+  return 0;
+}
+
+/* lets go of the journal without touching it */
+void editorJournalUnlock(void){
+  close(E.journal.fd);
+  E.journal.fd = -1;
+}
+
+/* the header keys the journal to the file's size and mtime */
+int editorJournalHeader(char* header){
+  struct stat st;
+  if (E.filename == NULL || stat(E.filename, &st) == -1) return -1;
+  int64_t key[3] = { st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+  memcpy(header, JOURNAL_MAGIC, 4);
+  memcpy(&header[4], key, sizeof(key));
+  return 0;
+}
+
+/* starts the journal over, reusing the locked file when there is one */
+int editorJournalCreate(void){
+  char header[JOURNAL_HEADER_SIZE];
+  if (editorJournalHeader(header) == -1) return -1;
+  if (E.journal.fd == -1 && editorJournalLock(O_CREAT) == -1) return -1;
+  if (ftruncate(E.journal.fd, 0) == -1 || lseek(E.journal.fd, 0, SEEK_SET) == -1){
+    editorJournalDiscard();
+    return -1;
+  }
+  if (write(E.journal.fd, header, sizeof(header)) != sizeof(header)){
+    editorJournalDiscard();
+    return -1;
+  }
+  return 0;
+}
+
+void editorJournalPack(char* rec, int op, int a, int b, int len){
+  int32_t fields[3] = { a, b, len };
+  rec[0] = op;
+  memcpy(&rec[1], fields, sizeof(fields));
+}
+
+void editorJournalAppend(int op, int a, int b, const char* s, int len){
+  char rec[JOURNAL_RECORD_SIZE];
+  editorJournalPack(rec, op, a, b, len);
+  abAppend(&E.journal.buf, rec, sizeof(rec));
+  if (len) abAppend(&E.journal.buf, s, len);
+}
+
+void editorJournalRecord(int op, int a, int b, const char* s, int len){
+  if (!E.journal.enabled || E.journal.replaying) return;
+  if (E.journal.fd == -1 && editorJournalCreate() == -1){
+    E.journal.enabled = 0;
+    return;
+  }
+  if (E.journal.buf.len == 0) editorJobStart(JOB_JOURNAL, JOURNAL_FLUSH_SECS * 1000);
+  editorJournalAppend(op, a, b, s, len);
+  if (E.journal.buf.len >= JOURNAL_BATCH) editorJournalFlush();
+}
+
+void editorJournalFlush(void){
+  if (E.journal.fd == -1 || E.journal.buf.len == 0) return;
+  editorJournalAppend(J_COMMIT, E.cy, E.cx, NULL, 0);
+  if (write(E.journal.fd, E.journal.buf.b, E.journal.buf.len) != E.journal.buf.len)
+    editorSetStatusMessage("Journal write failed: %s", strerror(errno));
+  abFree(&E.journal.buf);
+  E.journal.buf.b = NULL;
+  E.journal.buf.len = 0;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-  if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+/* The compacted journal is written by a forked child from its
+   copy-on-write image of the rows, like a save, so the session only pays
+   for the fork. It goes next to the old journal, locked so that no other
+   session can take it. The parent then appends the records written since
+   the fork and renames it over the old one. Offsets into the journal stay
+   valid while a save runs, so the two never overlap. */
+
+char* editorJournalCompactPath(void){
+  char* tmp = memAlloc(MEM_JOURNAL, strlen(E.journal.path) + 2);
+  sprintf(tmp, "%s~", E.journal.path);
+  return tmp;
 }
 
-void editorRowDelChar(erow *row, int at){
-  if (at < 0 || at > row->size) at = row->size;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+/* runs in the child, returns 0 or the errno to exit with */
+int editorJournalWriteText(int fd, const char* header, long long total){
+  static struct snapshotWriter w;
+  char rec[JOURNAL_RECORD_SIZE];
+  w.fd = fd;
+  w.progressfd = -1;
+  editorJournalPack(rec, J_TEXT, E.numrows, 0, total);
+  if (snapshotPut(&w, header, JOURNAL_HEADER_SIZE) == -1 ||
+      snapshotPut(&w, rec, sizeof(rec)) == -1)
+    return errno ? errno : EIO;
+  for (int i = 0; i < E.numrows; i++){
+    if (snapshotPut(&w, E.rows[i].chars, E.rows[i].size) == -1 ||
+        snapshotPut(&w, "\n", 1) == -1)
+      return errno ? errno : EIO;
+  }
+  editorJournalPack(rec, J_COMMIT, E.cy, E.cx, 0);
+  if (snapshotPut(&w, rec, sizeof(rec)) == -1 || snapshotFlush(&w) == -1)
+    return errno ? errno : EIO;
+  return 0;
 }
 
-void editorFreeRow(erow* row){
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+void editorJournalCompact(void){
+  if (E.journal.fd == -1 || E.journal.compactpid || E.save.pid) return;
+  off_t end = lseek(E.journal.fd, 0, SEEK_CUR);
+  if (end < JOURNAL_COMPACT) return;
+  long long total = 0;
+  for (int i = 0; i < E.numrows; i++) total += E.rows[i].size + 1;
+  if (end < 2 * total || total > INT32_MAX) return;
+
+  char header[JOURNAL_HEADER_SIZE];
+  if (editorJournalHeader(header) == -1) return;
+  char* tmp = editorJournalCompactPath();
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  pid_t pid = -1;
+  if (fd != -1 && flock(fd, LOCK_EX | LOCK_NB) == 0) pid = fork();
+  if (pid == 0) _exit(editorJournalWriteText(fd, header, total));
+  if (pid == -1){
+    if (fd != -1){
+      unlink(tmp);
+      close(fd);
+    }
+    memFree(tmp);
+    return;
+  }
+  memFree(tmp);
+  E.journal.compactpid = pid;
+  E.journal.compactfd = fd;
+  E.journal.compactfrom = end;
+  /* the yank a paste refers to is gone with the old records */
+  E.clip.journaled = 0;
 }
 
-void editorDelRow(int at){
-  if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.rows[at]);
-  memmove(&E.rows[at], &E.rows[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  for (int j = 0; j < E.numrows - 1; j++) E.rows[j].idx--;
-  E.numrows--;
-  E.dirty++;
+/* returns 1 while the child is still writing */
+int editorJournalCompactPoll(void){
+  int status;
+  pid_t done = waitpid(E.journal.compactpid, &status, WNOHANG);
+  if (done == 0) return 1;
+  int ok = done == E.journal.compactpid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  E.journal.compactpid = 0;
+  char* tmp = editorJournalCompactPath();
+  if (ok){
+    editorJournalFlush();
+    off_t end = lseek(E.journal.fd, 0, SEEK_END);
+    ssize_t taillen = end - E.journal.compactfrom;
+    char* tail = memAlloc(MEM_JOURNAL, taillen + 1);
+    ok = pread(E.journal.fd, tail, taillen, E.journal.compactfrom) == taillen &&
+         lseek(E.journal.compactfd, 0, SEEK_END) != -1 &&
+         write(E.journal.compactfd, tail, taillen) == taillen &&
+         rename(tmp, E.journal.path) == 0;
+    memFree(tail);
+  }
+  if (ok){
+    close(E.journal.fd);
+    E.journal.fd = E.journal.compactfd;
+  } else {
+    unlink(tmp);
+    close(E.journal.compactfd);
+  }
+  memFree(tmp);
+  return 0;
 }
 
-void editorRowAppendString(erow* row, char* s, size_t len){
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+/* stops a compaction, for a save or when the journal goes away */
+void editorJournalCompactCancel(void){
+  if (E.journal.compactpid == 0) return;
+  kill(E.journal.compactpid, SIGKILL);
+  waitpid(E.journal.compactpid, NULL, 0);
+  E.journal.compactpid = 0;
+  char* tmp = editorJournalCompactPath();
+  unlink(tmp);
+  close(E.journal.compactfd);
+  memFree(tmp);
 }
 
-/* editor operations */
+int editorJournalJob(int* redraw){
+  (void)redraw;
+  editorJournalFlush();
+  if (E.journal.compactpid && editorJournalCompactPoll()) return JOB_FRAME_MS;
+  editorJournalCompact();
+  return E.journal.compactpid ? JOB_FRAME_MS : JOB_DONE;
+}
 
-void editorInsertChar(int c){
-  if (E.cy == E.numrows){
-    editorInsertRow(E.numrows, "", 0);
+/* removes the journal if this session owns it */
+void editorJournalDiscard(void){
+  editorJournalCompactCancel();
+  if (E.journal.fd != -1){
+    unlink(E.journal.path);
+    close(E.journal.fd);
+    E.journal.fd = -1;
   }
-  editorRowInsertChar(&E.rows[E.cy], E.cx, c);
-  E.cx++;
+  abFree(&E.journal.buf);
+  E.journal.buf.b = NULL;
+  E.journal.buf.len = 0;
+  E.clip.journaled = 0;
 }
 
-void editorInsertNewLine(void){
-  if (E.cx == 0) {
-    editorInsertRow(E.cy, "", 0);
+/* After a save completes, records written before the snapshot are already
+   on disk, so the journal restarts from the new file with only the edits
+   made while the save was running. It is rewritten in place to keep the
+   lock. */
+void editorJournalRebase(off_t from){
+  char* tail = NULL;
+  ssize_t taillen = 0;
+  if (E.journal.fd != -1 && from >= 0){
+    editorJournalFlush();
+    off_t end = lseek(E.journal.fd, 0, SEEK_END);
+    if (end > from){
+      tail = memAlloc(MEM_JOURNAL, end - from);
+      taillen = pread(E.journal.fd, tail, end - from, from);
+    }
   }
-  else {
-    erow* row = &E.rows[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.rows[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+  abFree(&E.journal.buf);
+  E.journal.buf.b = NULL;
+  E.journal.buf.len = 0;
+  E.clip.journaled = 0;
+  if (taillen <= 0) editorJournalDiscard();
+  else if (editorJournalCreate() == 0){
+    if (write(E.journal.fd, tail, taillen) != taillen)
+      editorSetStatusMessage("Journal write failed: %s", strerror(errno));
   }
-  E.cy++;
-  E.cx = 0;
+  memFree(tail);
 }
 
-void editorDelChar(void){
-  if (E.cy == E.numrows) return;
-  if (E.cy == 0 && E.cx == 0) return;
-  erow* row = &E.rows[E.cy];
-  if (E.cx > 0){
-    editorRowDelChar(row, E.cx -1);
-    E.cx--;
+int editorJournalApply(int op, int a, int b, char* data, int len){
+  if (op == J_INSROW){
+    if (a < 0 || a > E.numrows) return -1;
+    editorInsertRow(a, data, len);
+    return 0;
   }
-  else {
-    E.cx = E.rows[E.cy - 1].size;
-    editorRowAppendString(&E.rows[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
+  if (op == J_PASTE){
+    if (a < 0 || a > E.numrows || E.clip.numrows == 0) return -1;
+    editorPasteRows(a);
+    return 0;
   }
+  if (op == J_TEXT){
+    if (E.numrows) editorDelRows(0, E.numrows);
+    for (int i = 0, start = 0; i < len; i++){
+      if (data[i] != '\n') continue;
+      editorInsertRow(E.numrows, &data[start], i - start);
+      start = i + 1;
+    }
+    return E.numrows == a ? 0 : -1;
+  }
+  if (op == J_CLIP){
+    /* rebuild the clipboard by yanking the text from scratch rows */
+    int at = E.numrows;
+    for (int i = 0, start = 0; i < len; i++){
+      if (data[i] != '\n') continue;
+      editorInsertRow(E.numrows, &data[start], i - start);
+      start = i + 1;
+    }
+    if (E.numrows - at != a){
+      editorDelRows(at, E.numrows - at);
+      return -1;
+    }
+    editorYankRows(at, a);
+    editorDelRows(at, a);
+    return 0;
+  }
+  if (a < 0 || a >= E.numrows) return -1;
+  erow* row = &E.rows[a];
+  switch (op){
+  case J_DELROW:
+    editorDelRow(a);
+    break;
+  case J_INSCHAR:
+    if (len != 1 || b < 0 || b > row->size) return -1;
+    editorRowInsertChar(row, b, data[0]);
+    break;
+  case J_DELCHAR:
+    if (len <= 0 || b < 0 || b + len > row->size || memcmp(&row->chars[b], data, len)) return -1;
+    editorRowDelChars(row, b, len);
+    break;
+  case J_APPEND:
+    editorRowAppendString(row, data, len);
+    break;
+  case J_TRUNC:
+    if (b < 0 || b > row->size) return -1;
+    editorRowTruncate(row, b);
+    break;
+  case J_YANK:
+    if (b <= 0 || a + b > E.numrows) return -1;
+    editorYankRows(a, b);
+    break;
+  case J_DELROWS:
+    if (b <= 0 || a + b > E.numrows) return -1;
+    editorDelRows(a, b);
+    break;
+  case J_BULK: {
+    if (b <= 0 || a + b > E.numrows) return -1;
+    char* cmd = memAlloc(MEM_JOURNAL, len + 1);
+    memcpy(cmd, data, len);
+    cmd[len] = '\0';
+    int kept = editorBulkRun(a, b, cmd);
+    memFree(cmd);
+    if (kept < 0) return -1;
+    break;
+  }
+  default:
+    return -1;
+  }
+  return 0;
 }
 
+void editorJournalRecover(void){
+  struct stat st;
+  if (E.filename == NULL || stat(E.filename, &st) == -1) return;
+  if (E.journal.fd != -1 || editorJournalLock(0) == -1) return;
+  int fd = E.journal.fd;
+
+  struct stat jst;
+  char* data = NULL;
+  if (fstat(fd, &jst) == -1 || jst.st_size < JOURNAL_HEADER_SIZE){
+    editorJournalUnlock();
+    return;
+  }
+  data = memAlloc(MEM_JOURNAL, jst.st_size);
+  ssize_t len = pread(fd, data, jst.st_size, 0);
+
+  char header[JOURNAL_HEADER_SIZE];
+  if (len != jst.st_size || editorJournalHeader(header) == -1 ||
+      memcmp(data, header, JOURNAL_HEADER_SIZE) != 0){
+    memFree(data);
+    editorSetStatusMessage("Ignoring stale journal %s", E.journal.path);
+    editorJournalUnlock();
+    return;
+  }
+
+  /* only batches terminated by a commit record are replayed */
+  ssize_t off = JOURNAL_HEADER_SIZE, committed = off;
+  while (off + JOURNAL_RECORD_SIZE <= len){
+    int32_t fields[3];
+    memcpy(fields, &data[off + 1], sizeof(fields));
+    if (fields[2] < 0 || off + JOURNAL_RECORD_SIZE + fields[2] > len) break;
+    off += JOURNAL_RECORD_SIZE + fields[2];
+    if (data[off - JOURNAL_RECORD_SIZE - fields[2]] == J_COMMIT) committed = off;
+  }
+
+  int edits = 0, cy = 0, cx = 0;
+  E.journal.replaying = 1;
+  for (off = JOURNAL_HEADER_SIZE; off < committed; ){
+    int op = data[off];
+    int32_t fields[3];
+    memcpy(fields, &data[off + 1], sizeof(fields));
+    off += JOURNAL_RECORD_SIZE;
+    if (op == J_COMMIT){
+      cy = fields[0];
+      cx = fields[1];
+    } else if (editorJournalApply(op, fields[0], fields[1], &data[off], fields[2]) == 0){
+      edits++;
+    }
+    off += fields[2];
+  }
+  E.journal.replaying = 0;
+  memFree(data);
+
+  if (committed > JOURNAL_HEADER_SIZE){
+    if (ftruncate(fd, committed) == -1) committed = lseek(fd, 0, SEEK_END);
+    lseek(fd, committed, SEEK_SET);
+  } else {
+    editorJournalUnlock();
+  }
+  if (cy > E.numrows) cy = E.numrows;
+  E.cy = cy;
+  E.cx = (cy < E.numrows && cx <= E.rows[cy].size) ? cx : 0;
+  if (edits) editorSetStatusMessage("Recovered %d edits from %s", edits, E.journal.path);
+}
 
 /* find */
 
@@ -693,11 +4025,13 @@ void editorFindCallback(char* query, int key){
   static int direction = 1;
 
   static int saved_hl_line;
-  static char* saved_hl = NULL;
+  static hlspan* saved_hl = NULL;
+  static int saved_hlsize;
 
   if (saved_hl){
-    memcpy(E.rows[saved_hl_line].hl, saved_hl, E.rows[saved_hl_line].rsize);
-    free(saved_hl);
+    memFree(E.rows[saved_hl_line].hl);
+    E.rows[saved_hl_line].hl = saved_hl;
+    E.rows[saved_hl_line].hlsize = saved_hlsize;
     saved_hl = NULL;
   }
 
@@ -723,16 +4057,19 @@ void editorFindCallback(char* query, int key){
     else if (current == E.numrows) current = 0;
 
     erow* row = &E.rows[current];
+    if (row->stale) editorUpdateRow(row);
     char* match = strstr(row->render, query);
     if (match) {
+      editorHighlightThrough(current);
       last_match = current;
       E.cy = current;
-      E.cx = editorRowRxtoCx(row, match - row->render);
+      E.cx = editorRowRxtoCx(row, editorRowRenderToRx(row, match - row->render));
       E.rowoff = E.numrows;
       saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+      saved_hlsize = row->hlsize;
+      saved_hl = memAlloc(MEM_SEARCH, sizeof(hlspan) * (row->hlsize + 1));
+      memcpy(saved_hl, row->hl, sizeof(hlspan) * row->hlsize);
+      editorRowSetSpan(row, match - row->render, strlen(query), HL_MATCH);
       break;
     }
   }
@@ -755,14 +4092,382 @@ void editorFind(void){
   }
 }
 
+/* word navigation */
+
+/* finds the occurrence of id in row before (dir -1) or after (dir 1)
+   byte offset from, returning its offset or -1 */
+int editorRowFindIdent(erow* row, ident* id, int from, int dir){
+  int found = -1;
+  int i = 0;
+  while (i < row->size){
+    if (!isIdentChar(row->chars[i])){
+      i++;
+      continue;
+    }
+    int start = i;
+    while (i < row->size && isIdentChar(row->chars[i])) i++;
+    if (i - start != id->len || memcmp(&row->chars[start], id->name, id->len)) continue;
+    if (dir > 0 && start > from) return start;
+    if (dir < 0 && start < from) found = start;
+  }
+  return found;
+}
+
+void editorJumpOccurrence(int dir){
+  if (E.cy >= E.numrows) return;
+  editorStaleFinish();
+  erow* row = &E.rows[E.cy];
+  int start = E.cx, end = E.cx;
+  while (start > 0 && isIdentChar(row->chars[start - 1])) start--;
+  while (end < row->size && isIdentChar(row->chars[end])) end++;
+  ident* id = (start < end) ? identLookup(&row->chars[start], end - start, 0) : NULL;
+  if (id == NULL){
+    editorSetStatusMessage("No identifier under cursor");
+    return;
+  }
+
+  int cx = editorRowFindIdent(row, id, start, dir);
+  int cy = E.cy;
+  if (cx == -1){
+    int pos = identRowPos(id, E.cy);
+    if (dir > 0){
+      if (pos < id->nrows && E.index.uidrow[id->rows[pos]] == E.cy) pos++;
+      if (pos == id->nrows) pos = 0;
+    } else {
+      pos = (pos == 0) ? id->nrows - 1 : pos - 1;
+    }
+    cy = E.index.uidrow[id->rows[pos]];
+    cx = editorRowFindIdent(&E.rows[cy], id, dir > 0 ? -1 : E.rows[cy].size + 1, dir);
+  }
+  E.cy = cy;
+  E.cx = cx;
+  editorSetStatusMessage("%s: %d occurrences in %d lines", id->name, id->total, id->nrows);
+}
+
+/* hex view */
+
+/* Binary files are shown read-only as rows of bytes straight out of a
+   mapping of the file. Nothing is split into lines or copied: a row is
+   formatted from its offset when it is drawn, so a file of any size opens
+   in constant memory. */
+
+#define HEX_PROBE 4096
+#define HEX_TYPEAHEAD (16 << 20)
+
+/* a file is treated as binary when its first block holds a NUL byte */
+int editorIsBinary(const char* filename){
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return 0;
+  char buf[HEX_PROBE];
+  ssize_t n = read(fd, buf, sizeof(buf));
+  close(fd);
+  return n > 0 && memchr(buf, '\0', n) != NULL;
+}
+
+void editorOpenHex(char* filename){
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1)
+    die("open");
+  E.hex.size = st.st_size;
+  E.hex.map = NULL;
+  if (E.hex.size > 0){
+    E.hex.map = mmap(NULL, E.hex.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (E.hex.map == MAP_FAILED)
+      die("mmap");
+  }
+  close(fd);
+
+  free(E.filename);
+  E.filename = strdup(filename);
+  E.hex.active = 1;
+  E.hex.cur = 0;
+  E.hex.top = 0;
+  E.hex.match = -1;
+  E.hex.digits = 8;
+  while (E.hex.digits < 16 && (E.hex.size - 1) >> (4 * E.hex.digits) > 0)
+    E.hex.digits++;
+  editorSetStatusMessage("HEX (read-only): Ctrl-F = find bytes or \"text\" | Ctrl-N/P = next/prev match | Ctrl-X = quit");
+}
+
+/* screen columns taken by a row of width bytes */
+int editorHexRowCols(int width){
+  return E.hex.digits + 2 + 3 * width + (width - 1) / 8 + 1 + width;
+}
+
+/* screen column of byte i of a row */
+int editorHexCol(int i){
+  return E.hex.digits + 2 + 3 * i + i / 8;
+}
+
+void editorHexScroll(void){
+  int width = 16;
+  while (width > 1 && editorHexRowCols(width) > E.screencols) width /= 2;
+  E.hex.width = width;
+
+  long long page = (long long)width * E.screenrows;
+  long long row = E.hex.cur - E.hex.cur % width;
+  E.hex.top -= E.hex.top % width;
+  if (row < E.hex.top) E.hex.top = row;
+  if (row >= E.hex.top + page) E.hex.top = row - page + width;
+}
+
+int editorHexColor(long long at){
+  if (E.hex.match >= 0 && at >= E.hex.match && at < E.hex.match + E.hex.patlen)
+    return editorSyntaxToColor(HL_MATCH);
+  return -1;
+}
+
+void editorHexDrawRows(struct abuff* lines){
+  static const char digits[] = "0123456789abcdef";
+  int width = E.hex.width;
+  for (int y = 0; y < E.screenrows; y++){
+    struct abuff* ab = &lines[y];
+    long long off = E.hex.top + (long long)y * width;
+    if (off >= E.hex.size){
+      abAppend(ab, "~", 1);
+      continue;
+    }
+    int n = E.hex.size - off < width ? E.hex.size - off : width;
+    const unsigned char* p = E.hex.map + off;
+
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%0*llx  ", E.hex.digits, off);
+    abAppend(ab, buf, len);
+    int color = -1;
+    for (int i = 0; i < width; i++){
+      int c = i < n ? editorHexColor(off + i) : -1;
+      if (c != color){
+        editorDrawSetColor(ab, c);
+        color = c;
+      }
+      if (i && i % 8 == 0) abAppend(ab, " ", 1);
+      if (i < n){
+        buf[0] = digits[p[i] >> 4];
+        buf[1] = digits[p[i] & 15];
+        buf[2] = ' ';
+        abAppend(ab, buf, 3);
+      } else {
+        abAppend(ab, "   ", 3);
+      }
+    }
+    if (color != -1) editorDrawSetColor(ab, -1);
+
+    abAppend(ab, " ", 1);
+    color = -1;
+    for (int i = 0; i < n; i++){
+      char ch = (p[i] >= 32 && p[i] < 127) ? p[i] : '.';
+      int c = editorHexColor(off + i);
+      if (c != color){
+        editorDrawSetColor(ab, c);
+        color = c;
+      }
+      if (off + i == E.hex.cur){
+        abAppend(ab, "\x1b[7m", 4);
+        abAppend(ab, &ch, 1);
+        abAppend(ab, "\x1b[m", 3);
+        if (color != -1) editorDrawSetColor(ab, color);
+      } else {
+        abAppend(ab, &ch, 1);
+      }
+    }
+    if (color != -1) editorDrawSetColor(ab, -1);
+  }
+}
+
+void editorHexMoveCursor(int key){
+  long long width = E.hex.width;
+  long long page = width * E.screenrows;
+  long long last = E.hex.size ? E.hex.size - 1 : 0;
+  switch (key){
+  case ARROW_LEFT:
+    E.hex.cur--;
+    break;
+  case ARROW_RIGHT:
+    E.hex.cur++;
+    break;
+  case ARROW_UP:
+    if (E.hex.cur >= width) E.hex.cur -= width;
+    break;
+  case ARROW_DOWN:
+    if (E.hex.cur + width <= last) E.hex.cur += width;
+    break;
+  case PAGE_UP:
+    E.hex.cur -= page;
+    E.hex.top -= page;
+    break;
+  case PAGE_DOWN:
+    E.hex.cur += page;
+    E.hex.top += page;
+    break;
+  case HOME_KEY:
+    E.hex.cur -= E.hex.cur % width;
+    break;
+  case END_KEY:
+    E.hex.cur += width - 1 - E.hex.cur % width;
+    break;
+  }
+  if (E.hex.cur > last) E.hex.cur = last;
+  if (E.hex.cur < 0) E.hex.cur = 0;
+  if (E.hex.top > last) E.hex.top = last;
+  if (E.hex.top < 0) E.hex.top = 0;
+}
+
+/* Patterns are hex bytes with optional spaces, "de ad be ef", or text in
+   double quotes. An odd trailing digit is ignored so the search follows
+   the prompt as it is typed. Returns the length, -1 when malformed. */
+int editorHexParse(const char* query, unsigned char* out){
+  int n = 0;
+  if (query[0] == '"'){
+    for (const char* s = query + 1; *s && !(*s == '"' && s[1] == '\0'); s++)
+      out[n++] = *s;
+    return n;
+  }
+  int half = -1;
+  for (const char* s = query; *s; s++){
+    if (*s == ' ') continue;
+    if (!isxdigit((unsigned char)*s)) return -1;
+    int v = isdigit((unsigned char)*s) ? *s - '0' : (tolower((unsigned char)*s) - 'a' + 10);
+    if (half < 0){
+      half = v;
+    } else {
+      out[n++] = half << 4 | v;
+      half = -1;
+    }
+  }
+  return n;
+}
+
+/* next match starting at or after from (dir 1), or at or before it
+   (dir -1), wrapping around the file. A forward search with a limit only
+   looks at that many bytes and does not wrap. */
+long long editorHexSearch(long long from, int dir, long long limit){
+  int n = E.hex.patlen;
+  const unsigned char* map = E.hex.map;
+  if (n <= 0 || n > E.hex.size) return -1;
+  long long last = E.hex.size - n;
+  if (dir > 0){
+    if (from > last || from < 0) from = 0;
+    long long len = E.hex.size - from;
+    if (limit && len > limit + n - 1) len = limit + n - 1;
+    const unsigned char* p = memmem(map + from, len, E.hex.pat, n);
+    if (!p && from > 0 && !limit) p = memmem(map, from + n - 1, E.hex.pat, n);
+    return p ? p - map : -1;
+  }
+  if (from > last || from < 0) from = last;
+  for (int pass = 0; pass < 2; pass++){
+    long long lo = pass ? from + 1 : 0;
+    long long hi = pass ? last : from;
+    while (lo <= hi){
+      const unsigned char* p = memrchr(map + lo, E.hex.pat[0], hi - lo + 1);
+      if (!p) break;
+      if (!memcmp(p, E.hex.pat, n)) return p - map;
+      hi = p - map - 1;
+    }
+  }
+  return -1;
+}
+
+/* While typing only the next HEX_TYPEAHEAD bytes are searched so the
+   prompt stays responsive on huge files; Enter and the arrows search the
+   whole file. */
+void editorHexFindCallback(char* query, int key){
+  if (key == '\x1b' || (key == '\r' && E.hex.match >= 0)) return;
+  long long from = E.hex.origin;
+  long long limit = 0;
+  int dir = 1;
+  if (key == ARROW_RIGHT || key == ARROW_DOWN){
+    from = E.hex.cur + 1;
+  } else if (key == ARROW_LEFT || key == ARROW_UP){
+    from = E.hex.cur - 1;
+    dir = -1;
+  } else if (key != '\r'){
+    E.hex.pat = memRealloc(MEM_SEARCH, E.hex.pat, strlen(query) + 1);
+    E.hex.patlen = editorHexParse(query, E.hex.pat);
+    limit = HEX_TYPEAHEAD;
+  }
+  E.hex.match = editorHexSearch(from, dir, limit);
+  if (E.hex.match >= 0) E.hex.cur = E.hex.match;
+}
+
+void editorHexFind(void){
+  long long saved_cur = E.hex.cur;
+  long long saved_top = E.hex.top;
+  E.hex.origin = E.hex.cur;
+
+  char* query = editorPrompt("Search: %s (hex bytes or \"text\", ESC/Arrows/Enter)", editorHexFindCallback);
+  if (query){
+    free(query);
+    if (E.hex.patlen < 0) editorSetStatusMessage("Not a hex pattern");
+    else if (E.hex.match < 0) editorSetStatusMessage("Not found");
+  } else {
+    E.hex.cur = saved_cur;
+    E.hex.top = saved_top;
+    E.hex.match = -1;
+  }
+}
+
+void editorHexFindNext(int dir){
+  if (E.hex.patlen <= 0){
+    editorSetStatusMessage("Nothing to search for, use Ctrl-F");
+    return;
+  }
+  long long at = editorHexSearch(E.hex.cur + dir, dir, 0);
+  if (at < 0){
+    editorSetStatusMessage("Not found");
+    return;
+  }
+  E.hex.match = at;
+  E.hex.cur = at;
+}
+
+void editorHexProcessKey(int c){
+  switch (c){
+  case ARROW_DOWN:
+  case ARROW_UP:
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+  case PAGE_UP:
+  case PAGE_DOWN:
+  case HOME_KEY:
+  case END_KEY:
+    editorHexMoveCursor(c);
+    break;
+  case CTRL_KEY('f'):
+    editorHexFind();
+    break;
+  case CTRL_KEY('n'):
+    editorHexFindNext(1);
+    break;
+  case CTRL_KEY('p'):
+    editorHexFindNext(-1);
+    break;
+  case CTRL_KEY('l'):
+  case '\x1b':
+    break;
+  default:
+    editorSetStatusMessage("Hex view is read-only");
+  }
+}
+
 /* Output */
 
 void editorScroll(void)
 {
   E.rx = 0;
   if (E.cy < E.numrows){
+    if (E.rows[E.cy].stale) editorUpdateRow(&E.rows[E.cy]);
     E.rx = editorRowCxtoRx(&E.rows[E.cy], E.cx);
   }
+  if (E.softwrap){
+    editorWrapSync();
+    int col;
+    int vline = editorWrapCursorLine(E.rx, &col);
+    E.coloff = 0;
+    if (vline < E.rowoff) E.rowoff = vline;
+    if (vline >= E.rowoff + E.screenrows) E.rowoff = vline - E.screenrows + 1;
+    return;
+  }
   if (E.cy < E.rowoff)
   {
     E.rowoff = E.cy;
@@ -782,12 +4487,128 @@ void editorScroll(void)
   }
 }
 
-void editorDrawRows(struct abuff *ab)
+void editorDrawSetColor(struct abuff *ab, int color)
+{
+  if (color == -1){
+    abAppend(ab, "\x1b[39m", 5);
+    return;
+  }
+  char buf[16];
+  int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+  abAppend(ab, buf, clen);
+}
+
+void editorDrawChunk(struct abuff *ab, char *s, int len, int color, int selected)
+{
+  int from = 0;
+  for (int j = 0; j < len; j++){
+    if (iscntrl((unsigned char)s[j])){
+      abAppend(ab, &s[from], j - from);
+      char sym = (s[j] <= 26) ? '@' + s[j] : '?';
+      abAppend(ab, "\x1b[7m", 4);
+      abAppend(ab, &sym, 1);
+      abAppend(ab, "\x1b[m", 3);
+      if (selected) abAppend(ab, "\x1b[7m", 4);
+      if (color != -1) editorDrawSetColor(ab, color);
+      from = j + 1;
+    }
+  }
+  abAppend(ab, &s[from], len - from);
+}
+
+void editorDrawRowSegment(struct abuff *ab, erow *row, int startcol, int ncols, int selected)
+{
+  if (row->stale) editorUpdateRow(row);
+  editorHighlightThrough(row->idx);
+  int start = editorRowRxToRender(row, startcol);
+  int end;
+  if (row->ascii){
+    end = start + ncols;
+    if (end > row->rsize) end = row->rsize;
+  } else {
+    int col = row->rcol[start];
+    /* a double-width character cut by startcol shows as a space */
+    if (start < row->rsize && col > startcol) abAppend(ab, " ", 1);
+    end = start;
+    while (end < row->rsize){
+      int cp;
+      int n = utf8Decode(&row->render[end], row->rsize - end, &cp);
+      int width = utf8Width(cp);
+      if (col + width > startcol + ncols) break;
+      col += width;
+      end += n;
+    }
+  }
+  if (start >= end) return;
+
+  int lo = 0, hi = row->hlsize;
+  while (lo < hi){
+    int mid = (lo + hi) / 2;
+    if (row->hl[mid].start + row->hl[mid].len <= start) lo = mid + 1;
+    else hi = mid;
+  }
+
+  int current_color = -1;
+  int pos = start;
+  int k = lo;
+  while (pos < end){
+    int chunk_end = end;
+    int color = -1;
+    if (k < row->hlsize && row->hl[k].start <= pos){
+      color = editorSyntaxToColor(row->hl[k].hl);
+      if (row->hl[k].start + row->hl[k].len < chunk_end)
+        chunk_end = row->hl[k].start + row->hl[k].len;
+      k++;
+    } else if (k < row->hlsize && row->hl[k].start < chunk_end){
+      chunk_end = row->hl[k].start;
+    }
+    if (color != current_color){
+      editorDrawSetColor(ab, color);
+      current_color = color;
+    }
+    editorDrawChunk(ab, &row->render[pos], chunk_end - pos, current_color, selected);
+    pos = chunk_end;
+  }
+  if (current_color != -1) editorDrawSetColor(ab, -1);
+}
+
+/* a selected line ends with one highlighted cell, so empty lines show */
+void editorDrawSelectionEnd(struct abuff *ab, int width)
+{
+  if (width < E.screencols) abAppend(ab, " ", 1);
+  abAppend(ab, "\x1b[m", 3);
+}
+
+/* + for rows added and ~ for rows changed since the last save */
+void editorDrawGutter(struct abuff *ab, erow *row)
+{
+  if (row == NULL || row->gen <= E.track.savegen)
+    abAppend(ab, "  ", 2);
+  else if (row->disksize < 0)
+    abAppend(ab, "\x1b[32m+\x1b[39m ", 12);
+  else
+    abAppend(ab, "\x1b[33m~\x1b[39m ", 12);
+}
+
+void editorDrawRows(struct abuff *lines)
 {
   int y;
+  int sub = 0;
+  int segstart = 0;
+  int filerow = E.rowoff;
+  if (E.softwrap){
+    filerow = editorWrapRowAt(E.rowoff, &sub);
+    if (filerow < E.numrows) segstart = editorWrapLineStart(&E.rows[filerow], sub);
+  }
+  int sel_first = -1, sel_last = -2;
+  if (E.mark >= 0) editorSelection(&sel_first, &sel_last);
   for (y = 0; y < E.screenrows; y++)
   {
-    int filerow = y + E.rowoff;
+    struct abuff *ab = &lines[y];
+    if (E.gutter)
+      editorDrawGutter(ab, filerow < E.numrows && sub == 0 ? &E.rows[filerow] : NULL);
+    int selected = filerow >= sel_first && filerow <= sel_last;
+    if (selected) abAppend(ab, "\x1b[7m", 4);
     if (filerow >= E.numrows)
     {
       if (E.numrows == 0 && y == E.screenrows / 3)
@@ -813,59 +4634,50 @@ void editorDrawRows(struct abuff *ab)
         abAppend(ab, "~", 1);
       }
     }
-    else
+    else if (E.softwrap)
     {
-      int len = E.rows[filerow].rsize - E.coloff;
-      if (len < 0) len = 0;
-      if (len > E.screencols) len = E.screencols;
-      char* c = &E.rows[filerow].render[E.coloff];
-			unsigned char* hl = &E.rows[filerow].hl[E.coloff];
-			int current_color = -1;
-      for (int j = 0; j < len; j++){
-        if (iscntrl(c[j])){
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1){
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-        }
-        if(hl[j] == HL_NORMAL){
-					if (current_color != -1){
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-					}
-          abAppend(ab, &c[j], 1);
-        }
-        else {
-          int color = editorSyntaxToColor(hl[j]);
-          if (color != current_color){
-            char buff[16];
-            int clen = snprintf(buff, sizeof(buff), "\x1b[%dm", color);
-            abAppend(ab, buff, clen);
-          }
-          abAppend(ab, &c[j], 1);
-        }
-        abAppend(ab, "\x1b[39m", 5);
+      erow *row = &E.rows[filerow];
+      editorDrawRowSegment(ab, row, segstart, E.screencols, selected);
+      if (selected) editorDrawSelectionEnd(ab, row->rwidth - segstart);
+      segstart = editorWrapNext(row, segstart);
+      if (++sub >= row->wrapheight)
+      {
+        sub = 0;
+        segstart = 0;
+        filerow++;
       }
     }
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
+    else
+    {
+      editorDrawRowSegment(ab, &E.rows[filerow], E.coloff, E.screencols, selected);
+      if (selected) editorDrawSelectionEnd(ab, E.rows[filerow].rwidth - E.coloff);
+      filerow++;
+    }
   }
 }
 
 void editorDrawStatusBar(struct abuff* ab){
   abAppend(ab, "\x1b[7m", 4);
-  char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]", E.numrows, E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->filetype : "no ft", E.cy + 0, E.numrows);
-  if (len > E.screencols) len = E.screencols;
+  char status[80], rstatus[80], state[24];
+  if (E.gz.active)
+    snprintf(state, sizeof(state), "(loading %d%%)", (int)(E.gz.pos * 100 / (E.gz.inlen ? E.gz.inlen : 1)));
+  else if (E.save.pid > 0)
+    snprintf(state, sizeof(state), "(saving %d%%)", E.save.total ? (int)(E.save.written * 100 / E.save.total) : 0);
+  else
+    snprintf(state, sizeof(state), "%s", E.dirty ? "(modified)" : "");
+  int len, rlen;
+  if (E.hex.active){
+    len = snprintf(status, sizeof(status), "%.20s - %lld bytes (hex, read-only)", E.filename, E.hex.size);
+    rlen = snprintf(rstatus, sizeof(rstatus), "0x%llx/0x%llx", E.hex.cur, E.hex.size);
+  } else {
+    len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]", E.numrows, state);
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->filetype : "no ft", E.cy + 0, E.numrows);
+  }
+  int cols = E.screencols + E.gutter;
+  if (len > cols) len = cols;
   abAppend(ab, status, len);
-  while (len < E.screencols) {
-    if (E.screencols - len == rlen){
+  while (len < cols) {
+    if (cols - len == rlen){
       abAppend(ab, rstatus, rlen);
       break;
     }
@@ -887,31 +4699,158 @@ void editorSetStatusMessage(const char* fmt, ...){
 void editorDrawMessageBar(struct abuff* ab){
   abAppend(ab, "\x1b[K", 3);
   int msglen = strlen(E.statusmsg);
-  if (msglen > E.screencols) msglen = E.screencols;
+  if (msglen > E.screencols + E.gutter) msglen = E.screencols + E.gutter;
   if (msglen && time(NULL) - E.statusmsg_time < 5){
     abAppend(ab, E.statusmsg, msglen);
   }
 }
 
+/* live bytes per subsystem, largest first */
+void editorShowMemory(void){
+  int order[MEM_TAGS];
+  for (int i = 0; i < MEM_TAGS; i++){
+    int j = i;
+    while (j > 0 && mem_stats[order[j - 1]].bytes < mem_stats[i].bytes){
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = i;
+  }
+  char msg[sizeof(E.statusmsg)], a[16], b[16], c[16];
+  int len = snprintf(msg, sizeof(msg), "mem %s peak %s rss %s:",
+                     memFormat(mem_live, a, sizeof(a)), memFormat(mem_peak, b, sizeof(b)),
+                     memFormat(memPeakRss(), c, sizeof(c)));
+  for (int i = 0; i < MEM_TAGS && len < (int)sizeof(msg); i++){
+    struct memCounter* mc = &mem_stats[order[i]];
+    if (mc->blocks == 0) continue;
+    len += snprintf(&msg[len], sizeof(msg) - len, " %s %s", mem_names[order[i]],
+                    memFormat(mc->bytes, a, sizeof(a)));
+  }
+  editorSetStatusMessage("%s", msg);
+}
+
+/* registered with -m, runs after the terminal is restored */
+void editorDumpMemory(void){
+  fprintf(stderr, "%-10s %14s %10s\n", "subsystem", "bytes", "blocks");
+  for (int i = 0; i < MEM_TAGS; i++)
+    fprintf(stderr, "%-10s %14lld %10lld\n", mem_names[i], mem_stats[i].bytes, mem_stats[i].blocks);
+  fprintf(stderr, "%-10s %14lld\n", "live", mem_live);
+  fprintf(stderr, "%-10s %14lld\n", "peak", mem_peak);
+  fprintf(stderr, "%-10s %14lld\n", "peak rss", memPeakRss());
+}
+
 void editorClearScreen(void)
 {
+  E.frame.valid = 0;
   write(STDOUT_FILENO, "\x1b[2J", 4);
   write(STDOUT_FILENO, "\x1b[H", 3);
 }
 
+/* E.frame keeps the bytes last sent for every text row. A small change of
+   E.rowoff shifts the old rows with a scroll region instead of resending
+   them, then only rows whose bytes differ are drawn. */
+void editorFrameFit(void)
+{
+  struct EditorFrame *f = &E.frame;
+  if (f->rows == E.screenrows && f->cols == E.screencols) return;
+  for (int y = 0; y < f->rows; y++){
+    abFree(&f->lines[y]);
+    abFree(&f->next[y]);
+  }
+  f->rows = E.screenrows;
+  f->cols = E.screencols;
+  f->lines = memRealloc(MEM_SCREEN, f->lines, sizeof(struct abuff) * f->rows);
+  f->next = memRealloc(MEM_SCREEN, f->next, sizeof(struct abuff) * f->rows);
+  for (int y = 0; y < f->rows; y++){
+    f->lines[y] = (struct abuff)ABUFF_INIT;
+    f->next[y] = (struct abuff)ABUFF_INIT;
+  }
+  f->valid = 0;
+}
+
+void editorFrameScroll(struct abuff *ab, long long top)
+{
+  struct EditorFrame *f = &E.frame;
+  if (!f->valid || top == f->rowoff || llabs(top - f->rowoff) >= f->rows) return;
+  int shift = top - f->rowoff;
+  if (E.coloff != f->coloff || E.softwrap != f->softwrap) return;
+
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+                     f->rows, abs(shift), shift > 0 ? 'S' : 'T');
+  abAppend(ab, buf, len);
+
+  /* rotate so lines[y] holds what the terminal now shows at row y, the
+     rows scrolled in are blank */
+  struct abuff old[f->rows];
+  memcpy(old, f->lines, sizeof(old));
+  for (int y = 0; y < f->rows; y++){
+    int from = (y + shift + f->rows) % f->rows;
+    f->lines[y] = old[from];
+    if (y + shift < 0 || y + shift >= f->rows) f->lines[y].len = 0;
+  }
+}
+
 void editorRefreshScreen(void)
 {
-  editorScroll();
+  if (E.hex.active) editorHexScroll();
+  else editorScroll();
+  editorFrameFit();
+  struct EditorFrame *f = &E.frame;
   struct abuff ab = ABUFF_INIT;
-  abAppend(&ab, "\x1b[H", 3);
   abAppend(&ab, "\x1b[?25l", 6);
 
-  editorDrawRows(&ab);
+  for (int y = 0; y < f->rows; y++) f->next[y].len = 0;
+  long long top = E.rowoff;
+  if (E.hex.active){
+    editorHexDrawRows(f->next);
+    top = E.hex.top / E.hex.width;
+  } else {
+    editorDrawRows(f->next);
+  }
+  editorFrameScroll(&ab, top);
+
+  char buf[32];
+  int last = -2;
+  for (int y = 0; y < f->rows; y++){
+    struct abuff *line = &f->next[y];
+    if (f->valid && line->len == f->lines[y].len &&
+        memcmp(line->b, f->lines[y].b, line->len) == 0)
+      continue;
+    if (y == last + 1){
+      abAppend(&ab, "\r\n", 2);
+    } else {
+      int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+      abAppend(&ab, buf, len);
+    }
+    abAppend(&ab, line->b, line->len);
+    abAppend(&ab, "\x1b[K", 3);
+    last = y;
+    struct abuff tmp = f->lines[y];
+    f->lines[y] = *line;
+    *line = tmp;
+  }
+  f->valid = 1;
+  f->rowoff = top;
+  f->coloff = E.coloff;
+  f->softwrap = E.softwrap;
+
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", f->rows + 1);
+  abAppend(&ab, buf, len);
   editorDrawStatusBar(&ab);
   editorDrawMessageBar(&ab);
 
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
+  int cursor_y = E.cy - E.rowoff;
+  int cursor_x = E.rx - E.coloff;
+  if (E.softwrap){
+    cursor_y = editorWrapCursorLine(E.rx, &cursor_x) - E.rowoff;
+  }
+  cursor_x += E.gutter;
+  if (E.hex.active){
+    cursor_y = (E.hex.cur - E.hex.top) / E.hex.width;
+    cursor_x = editorHexCol(E.hex.cur % E.hex.width);
+  }
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cursor_y + 1, cursor_x + 1);
   abAppend(&ab, buf, strlen(buf));
 
   abAppend(&ab, "\x1b[?25h", 6);
@@ -948,7 +4887,7 @@ char* editorPrompt(char *promptFmt, void(*callback)(char*, int)){
     else if (c == DEL_KEY || c == CTRL_KEY('h') || c == 127){
       if (bufflen != 0) buff[--bufflen] = '\0';
     }
-    else if (!iscntrl(c) && c < 128){
+    else if (!iscntrl(c) && c < 256){
       if (bufflen == buffsize - 1){
         buffsize *= 2;
         buff = realloc(buff, buffsize);
@@ -962,19 +4901,23 @@ char* editorPrompt(char *promptFmt, void(*callback)(char*, int)){
 
 void editorMoveCursor(int key)
 {
+  if (E.softwrap && (key == ARROW_UP || key == ARROW_DOWN)){
+    editorWrapMoveCursor(key);
+    return;
+  }
   erow *row = (E.cy >= E.numrows) ? NULL : &E.rows[E.cy];
   switch (key)
   {
-   case ARROW_DOWN:
-     if (E.cy != E.rowoff - 1) E.cy++;
-     break;
+  case ARROW_DOWN:
+    if (E.cy < E.numrows) E.cy++;
+    break;
   case ARROW_UP:
     if (E.cy != 0)
       E.cy--;
     break;
   case ARROW_LEFT:
     if (E.cx != 0)
-      E.cx--;
+      E.cx = editorRowPrevChar(row, E.cx);
     else if (E.cy > 0 && E.numrows > 0){
       E.cy--;
       E.cx = E.rows[E.cy].size;
@@ -982,7 +4925,7 @@ void editorMoveCursor(int key)
     break;
   case ARROW_RIGHT:
     if(row && E.cx < row->size)
-      E.cx++;
+      E.cx = editorRowNextChar(row, E.cx);
     else if (row && E.cx == row->size && E.numrows > 0){
       E.cy++;
       E.cx = 0;
@@ -1001,6 +4944,10 @@ void editorProcessKeypress(void)
 {
   static int quit_times = QUIT_TIMES;
   int c = editorReadKey();
+  if (E.hex.active && c != CTRL_KEY('x') && c != CTRL_KEY('t')){
+    editorHexProcessKey(c);
+    return;
+  }
   switch (c)
   {
   case '\r':
@@ -1013,6 +4960,7 @@ void editorProcessKeypress(void)
       quit_times--;
       return;
     }
+    editorJournalDiscard();
     editorClearScreen();
     exit(0);
     break;
@@ -1027,6 +4975,16 @@ void editorProcessKeypress(void)
   case PAGE_UP:
   case PAGE_DOWN:
   {
+    if (E.softwrap){
+      editorWrapSync();
+      int target = (c == PAGE_UP) ? E.rowoff - E.screenrows
+                                  : E.rowoff + 2 * E.screenrows - 1;
+      int total = editorWrapPrefix(E.numrows);
+      if (target < 0) target = 0;
+      if (target > total) target = total;
+      editorWrapMoveTo(target, 0);
+      break;
+    }
     if (c == PAGE_UP){
       E.cy = E.rowoff;
     } else if (c == PAGE_DOWN){
@@ -1052,6 +5010,36 @@ void editorProcessKeypress(void)
   case CTRL_KEY('f'):
     editorFind();
     break;
+  case CTRL_KEY('w'):
+    editorToggleSoftWrap();
+    break;
+  case CTRL_KEY('g'):
+    editorToggleGutter();
+    break;
+  case CTRL_KEY('n'):
+    editorJumpOccurrence(1);
+    break;
+  case CTRL_KEY('t'):
+    editorShowMemory();
+    break;
+  case CTRL_KEY('b'):
+    editorToggleMark();
+    break;
+  case CTRL_KEY('c'):
+    editorCopy(0);
+    break;
+  case CTRL_KEY('k'):
+    editorCopy(1);
+    break;
+  case CTRL_KEY('v'):
+    editorPaste();
+    break;
+  case CTRL_KEY('o'):
+    editorBulk();
+    break;
+  case CTRL_KEY('p'):
+    editorJumpOccurrence(-1);
+    break;
   case BACKSPACE:
   case CTRL_KEY('h'):
   case DEL_KEY:
@@ -1067,12 +5055,763 @@ void editorProcessKeypress(void)
   quit_times = QUIT_TIMES;
 }
 
+/* batch mode */
+
+/* ctext -e script file applies a script of editor commands without a
+   terminal. The file is streamed forward once and only the current line is
+   held in memory, so lines are addressed by their number in the original
+   file and a script can never move backwards. Unless the script saves, the
+   result is written to stdout. */
+
+struct batchState
+{
+  const char *script;
+  int cmdline;
+  FILE *in;
+  FILE *out;
+  char *line;
+  size_t linecap;
+  ssize_t linelen;
+  long lineno;
+  int outnl;
+  char *scratch;
+  size_t scratchcap;
+};
+
+int batchError(struct batchState *b, const char *fmt, ...)
+{
+  va_list ap;
+  fprintf(stderr, "%s:%d: ", b->script, b->cmdline);
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+  return -1;
+}
+
+void batchWrite(struct batchState *b, const char *s, size_t len)
+{
+  if (len == 0)
+    return;
+  fwrite(s, 1, len, b->out);
+  b->outnl = s[len - 1] == '\n';
+}
+
+/* writes out the held line, if any */
+void batchEmit(struct batchState *b)
+{
+  if (b->linelen < 0)
+    return;
+  batchWrite(b, b->line, b->linelen);
+  b->linelen = -1;
+}
+
+/* holds the next input line, returns 0 at the end of the file */
+int batchNext(struct batchState *b)
+{
+  b->linelen = getline(&b->line, &b->linecap, b->in);
+  if (b->linelen < 0)
+    return 0;
+  b->lineno++;
+  return 1;
+}
+
+/* length of the held line without its line terminator */
+size_t batchTextLen(struct batchState *b)
+{
+  size_t len = b->linelen;
+  while (len > 0 && (b->line[len - 1] == '\n' || b->line[len - 1] == '\r'))
+    len--;
+  return len;
+}
+
+/* replaces every occurrence of old in the held line, returns the count */
+int batchReplaceLine(struct batchState *b, const char *old, size_t oldlen,
+                     const char *new, size_t newlen)
+{
+  size_t textlen = batchTextLen(b);
+  char *p = memmem(b->line, textlen, old, oldlen);
+  if (!p)
+    return 0;
+  int count = 0;
+  size_t len = 0;
+  size_t at = 0;
+  while (p)
+  {
+    size_t skip = p - (b->line + at);
+    size_t need = len + skip + newlen + (b->linelen - at);
+    if (need > b->scratchcap)
+    {
+      b->scratchcap = need * 2;
+      b->scratch = realloc(b->scratch, b->scratchcap);
+    }
+    memcpy(&b->scratch[len], &b->line[at], skip);
+    len += skip;
+    memcpy(&b->scratch[len], new, newlen);
+    len += newlen;
+    at += skip + oldlen;
+    count++;
+    p = memmem(&b->line[at], textlen - at, old, oldlen);
+  }
+  memcpy(&b->scratch[len], &b->line[at], b->linelen - at);
+  len += b->linelen - at;
+
+  char *tmp = b->line;
+  size_t tmpcap = b->linecap;
+  b->line = b->scratch;
+  b->linecap = b->scratchcap;
+  b->linelen = len;
+  b->scratch = tmp;
+  b->scratchcap = tmpcap;
+  return count;
+}
+
+/* splits "/old/new/" (any delimiter) in place */
+int batchParseReplace(char *arg, char **old, char **new)
+{
+  char delim = arg[0];
+  if (delim == '\0')
+    return -1;
+  *old = &arg[1];
+  char *mid = strchr(*old, delim);
+  if (!mid || mid == *old)
+    return -1;
+  *mid = '\0';
+  *new = mid + 1;
+  char *end = strchr(*new, delim);
+  if (end)
+    *end = '\0';
+  return 0;
+}
+
+int batchCommand(struct batchState *b, char *cmd, char *arg)
+{
+  if (!strcmp(cmd, "goto"))
+  {
+    long n = atol(arg);
+    if (n < 1)
+      return batchError(b, "goto: bad line number '%s'", arg);
+    if (n == b->lineno && b->linelen >= 0)
+      return 0;
+    if (n <= b->lineno)
+      return batchError(b, "goto %ld: line already passed", n);
+    while (b->lineno < n)
+    {
+      batchEmit(b);
+      if (!batchNext(b))
+        return batchError(b, "goto %ld: file has %ld lines", n, b->lineno);
+    }
+  }
+  else if (!strcmp(cmd, "find"))
+  {
+    size_t len = strlen(arg);
+    if (len == 0)
+      return batchError(b, "find: missing text");
+    do
+    {
+      batchEmit(b);
+      if (!batchNext(b))
+        return batchError(b, "find: '%s' not found", arg);
+    } while (!memmem(b->line, batchTextLen(b), arg, len));
+  }
+  else if (!strcmp(cmd, "insert"))
+  {
+    batchEmit(b);
+    if (!b->outnl)
+      batchWrite(b, "\n", 1);
+    batchWrite(b, arg, strlen(arg));
+    batchWrite(b, "\n", 1);
+  }
+  else if (!strcmp(cmd, "delete"))
+  {
+    long n = *arg ? atol(arg) : 1;
+    if (n < 1)
+      return batchError(b, "delete: bad count '%s'", arg);
+    if (b->linelen >= 0)
+    {
+      b->linelen = -1;
+      n--;
+    }
+    for (; n > 0; n--)
+      if (!batchNext(b))
+        return batchError(b, "delete: end of file after line %ld", b->lineno);
+    b->linelen = -1;
+  }
+  else if (!strcmp(cmd, "replace") || !strcmp(cmd, "replaceall"))
+  {
+    char *old, *new;
+    if (batchParseReplace(arg, &old, &new) == -1)
+      return batchError(b, "%s: expected /old/new/", cmd);
+    size_t oldlen = strlen(old);
+    size_t newlen = strlen(new);
+    if (!strcmp(cmd, "replace"))
+    {
+      if (b->linelen < 0)
+        return batchError(b, "replace: no current line");
+      if (batchReplaceLine(b, old, oldlen, new, newlen) == 0)
+        return batchError(b, "replace: '%s' not on line %ld", old, b->lineno);
+      return 0;
+    }
+    /* rewrites the current line and everything after it */
+    if (b->linelen < 0 && !batchNext(b))
+      return 0;
+    do
+    {
+      batchReplaceLine(b, old, oldlen, new, newlen);
+      batchEmit(b);
+    } while (batchNext(b));
+  }
+  else
+  {
+    return batchError(b, "unknown command '%s'", cmd);
+  }
+  return 0;
+}
+
+int editorBatch(const char *script, const char *filename)
+{
+  struct batchState b = {0};
+  b.script = script;
+  b.linelen = -1;
+  b.outnl = 1;
+
+  FILE *sp = strcmp(script, "-") ? fopen(script, "r") : stdin;
+  if (!sp)
+  {
+    fprintf(stderr, "%s: %s\n", script, strerror(errno));
+    return 1;
+  }
+  b.in = fopen(filename, "r");
+  if (!b.in)
+  {
+    fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+    return 1;
+  }
+  static char inbuf[1 << 16], outbuf[1 << 16];
+  setvbuf(b.in, inbuf, _IOFBF, sizeof(inbuf));
+
+  /* the output target is known only once save is seen, and save must come
+     last, so the script is read up front */
+  char **cmds = NULL;
+  int ncmds = 0;
+  char *cmd = NULL;
+  size_t cmdcap = 0;
+  ssize_t cmdlen;
+  while ((cmdlen = getline(&cmd, &cmdcap, sp)) != -1)
+  {
+    while (cmdlen > 0 && (cmd[cmdlen - 1] == '\n' || cmd[cmdlen - 1] == '\r'))
+      cmd[--cmdlen] = '\0';
+    cmds = realloc(cmds, sizeof(char *) * (ncmds + 1));
+    cmds[ncmds++] = strdup(cmd);
+  }
+  free(cmd);
+  if (sp != stdin)
+    fclose(sp);
+
+  const char *target = NULL;
+  int last = ncmds;
+  for (int i = 0; i < ncmds; i++)
+  {
+    char *s = cmds[i];
+    while (isspace((unsigned char)*s))
+      s++;
+    if (strncmp(s, "save", 4) || (s[4] && !isspace((unsigned char)s[4])))
+      continue;
+    s += 4;
+    while (isspace((unsigned char)*s))
+      s++;
+    target = *s ? s : filename;
+    last = i;
+    for (int j = i + 1; j < ncmds; j++)
+    {
+      char *t = cmds[j];
+      while (isspace((unsigned char)*t))
+        t++;
+      if (*t && *t != '#')
+      {
+        b.cmdline = j + 1;
+        batchError(&b, "commands after save");
+        return 1;
+      }
+    }
+    break;
+  }
+
+  char *tmpname = NULL;
+  if (target)
+  {
+    tmpname = malloc(strlen(target) + 8);
+    sprintf(tmpname, "%s.XXXXXX", target);
+    int fd = mkstemp(tmpname);
+    if (fd == -1 || !(b.out = fdopen(fd, "w")))
+    {
+      fprintf(stderr, "%s: %s\n", target, strerror(errno));
+      return 1;
+    }
+    struct stat st;
+    if (stat(target, &st) == 0)
+      fchmod(fd, st.st_mode & 07777);
+    else
+      fchmod(fd, 0644);
+  }
+  else
+  {
+    b.out = stdout;
+  }
+  setvbuf(b.out, outbuf, _IOFBF, sizeof(outbuf));
+
+  int err = 0;
+  for (int i = 0; i < last && !err; i++)
+  {
+    b.cmdline = i + 1;
+    char *s = cmds[i];
+    while (isspace((unsigned char)*s))
+      s++;
+    if (*s == '\0' || *s == '#')
+      continue;
+    char *arg = s;
+    while (*arg && !isspace((unsigned char)*arg))
+      arg++;
+    if (*arg)
+      *arg++ = '\0';
+    while (isspace((unsigned char)*arg))
+      arg++;
+    err = batchCommand(&b, s, arg) == -1;
+  }
+
+  if (!err)
+  {
+    batchEmit(&b);
+    size_t n;
+    while ((n = fread(inbuf, 1, sizeof(inbuf), b.in)) > 0)
+      batchWrite(&b, inbuf, n);
+    if (ferror(b.in))
+    {
+      fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+      err = 1;
+    }
+  }
+  fclose(b.in);
+  if (fflush(b.out) == EOF || (tmpname && fsync(fileno(b.out)) == -1))
+  {
+    fprintf(stderr, "%s: %s\n", target ? target : "stdout", strerror(errno));
+    err = 1;
+  }
+  if (tmpname)
+  {
+    fclose(b.out);
+    if (!err && rename(tmpname, target) == -1)
+    {
+      fprintf(stderr, "%s: %s\n", target, strerror(errno));
+      err = 1;
+    }
+    if (err)
+      unlink(tmpname);
+    free(tmpname);
+  }
+  for (int i = 0; i < ncmds; i++)
+    free(cmds[i]);
+  free(cmds);
+  free(b.line);
+  free(b.scratch);
+  return err;
+}
+
+/* server */
+
+/* ctext --server keeps files loaded between editing sessions. It listens
+   on ctext.sock in a private directory and gives every file a holder
+   process, which loads it once, brings its highlighting and index up to
+   date and then forks a session for each client. A session starts from a copy-on-write
+   image of its holder, so attaching is instant and terminals showing the
+   same file share its memory until they change it. A holder is replaced
+   once its file changes on disk, and the least recently used one makes
+   room when SERVER_FILES are held.
+
+   ctext -a <file> is the client: it sends "<rows> <cols> <path>\n", puts
+   the terminal in raw mode and relays bytes both ways. Window size
+   changes go in band as ESC [ 8 ; rows ; cols t. */
+
+#define SERVER_FILES 8
+#define SERVER_REQUEST_MS 1000
+
+struct serverHolder
+{
+  char* path;
+  pid_t pid;
+  int fd;
+  off_t size;
+  struct timespec mtime;
+  long long used;
+};
+
+/* The socket goes in $XDG_RUNTIME_DIR, or else in /tmp/ctext-<uid>.
+   Another user can create that name first, so the directory is only used
+   when lstat shows a real directory that is ours and closed to others. */
+int serverSocketPath(struct sockaddr_un* addr){
+  char dir[sizeof(addr->sun_path)];
+  const char* run = getenv("XDG_RUNTIME_DIR");
+  if (run && *run) snprintf(dir, sizeof(dir), "%s", run);
+  else {
+    snprintf(dir, sizeof(dir), "/tmp/ctext-%d", (int)getuid());
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST){
+      perror(dir);
+      return -1;
+    }
+  }
+  struct stat st;
+  if (lstat(dir, &st) == -1){
+    perror(dir);
+    return -1;
+  }
+  if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)){
+    fprintf(stderr, "ctext: %s is not a private directory of yours\n", dir);
+    return -1;
+  }
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/ctext.sock", dir) >=
+      (int)sizeof(addr->sun_path)){
+    fprintf(stderr, "ctext: %s: socket path too long\n", dir);
+    return -1;
+  }
+  return 0;
+}
+
+/* whether the other end of a connected socket runs as this user */
+int serverPeerIsUs(int fd){
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+int serverWrite(int fd, const char* s, size_t len){
+  while (len > 0){
+    ssize_t n = write(fd, s, len);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    s += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* sends msg with a descriptor attached */
+int serverSendFd(int sock, int fd, const char* msg, int len){
+  char ctl[CMSG_SPACE(sizeof(int))];
+  memset(ctl, 0, sizeof(ctl));
+  struct iovec iov = { (void*)msg, len };
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctl;
+  mh.msg_controllen = sizeof(ctl);
+  struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+  return sendmsg(sock, &mh, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+/* returns the message length, *fd is the descriptor attached or -1 */
+int serverRecvFd(int sock, char* msg, int len, int* fd){
+  char ctl[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { msg, len };
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctl;
+  mh.msg_controllen = sizeof(ctl);
+  int n;
+  do n = recvmsg(sock, &mh, 0); while (n == -1 && errno == EINTR);
+  *fd = -1;
+  struct cmsghdr* cm = n > 0 ? CMSG_FIRSTHDR(&mh) : NULL;
+  if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+    memcpy(fd, CMSG_DATA(cm), sizeof(int));
+  return n;
+}
+
+/* runs in a child of the holder with the client's socket as its terminal */
+void serverSession(int fd, int rows, int cols){
+  dup2(fd, STDIN_FILENO);
+  dup2(fd, STDOUT_FILENO);
+  if (fd > STDOUT_FILENO) close(fd);
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGPIPE, SIG_IGN);
+  editorInstallSignals();
+  E.attach.holding = 0;
+  E.attach.rows = rows;
+  E.attach.cols = cols;
+  editorHandleResize();
+  editorSetStatusMessage(HELP_MESSAGE);
+  if (E.journal.enabled) editorJournalRecover();
+  while (true)
+  {
+    editorRefreshScreen();
+    editorProcessKeypress();
+  }
+}
+
+/* loads path and forks a session for every client sent over ctl, until
+   the server closes it. The holder leaves the server's terminal session,
+   so a Ctrl-C or hangup there does not reach it or its sessions. */
+void serverHold(char* path, int ctl){
+  setsid();
+  signal(SIGCHLD, SIG_IGN);
+  E.attach.active = 1;
+  E.attach.holding = 1;
+  E.attach.rows = 24;
+  E.attach.cols = 80;
+  initEditor();
+  editorOpen(path);
+  editorGzipFinish();
+  editorStaleFinish();
+  editorHighlightThrough(E.numrows);
+  for (;;){
+    char msg[32];
+    int fd;
+    int n = serverRecvFd(ctl, msg, sizeof(msg) - 1, &fd);
+    if (n <= 0) _exit(0);
+    if (fd == -1) continue;
+    msg[n] = '\0';
+    int rows = 24, cols = 80;
+    sscanf(msg, "%d %d", &rows, &cols);
+    if (fork() == 0){
+      close(ctl);
+      serverSession(fd, rows, cols);
+    }
+    close(fd);
+  }
+}
+
+/* the holder exits once its end of the socket is closed, its sessions
+   carry on */
+void serverRelease(struct serverHolder* h){
+  if (h->path == NULL) return;
+  close(h->fd);
+  free(h->path);
+  h->path = NULL;
+}
+
+int serverSpawn(struct serverHolder* held, struct serverHolder* h, char* path,
+                struct stat* st, int lfd, int cfd){
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) return -1;
+  pid_t pid = fork();
+  if (pid == -1){
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+  if (pid == 0){
+    close(lfd);
+    close(cfd);
+    close(sv[0]);
+    for (int i = 0; i < SERVER_FILES; i++)
+      if (held[i].path) close(held[i].fd);
+    serverHold(path, sv[1]);
+  }
+  close(sv[1]);
+  h->path = strdup(path);
+  h->pid = pid;
+  h->fd = sv[0];
+  h->size = st->st_size;
+  h->mtime = st->st_mtim;
+  return 0;
+}
+
+/* reads a client's request and hands its socket to the file's holder */
+void serverAccept(struct serverHolder* held, int lfd, int cfd, long long tick){
+  char req[PATH_MAX + 32];
+  char* nl = NULL;
+  int len = 0;
+  long long deadline = editorNowMs() + SERVER_REQUEST_MS;
+  /* a client gets SERVER_REQUEST_MS in all to send its request, the accept
+     loop waits on nobody for longer */
+  while (nl == NULL && len < (int)sizeof(req) - 1){
+    struct pollfd pfd = { cfd, POLLIN, 0 };
+    long long wait = deadline - editorNowMs();
+    if (wait <= 0 || poll(&pfd, 1, wait) <= 0) return;
+    /* peek first, keys typed after the request must stay for the session */
+    ssize_t n = recv(cfd, &req[len], sizeof(req) - 1 - len, MSG_PEEK);
+    if (n <= 0) return;
+    nl = memchr(&req[len], '\n', n);
+    if (nl) n = nl - &req[len] + 1;
+    if (read(cfd, &req[len], n) != n) return;
+    len += n;
+  }
+  if (nl == NULL) return;
+  *nl = '\0';
+
+  int rows, cols, off = 0;
+  if (sscanf(req, "%d %d %n", &rows, &cols, &off) != 2 || off == 0) return;
+  char* path = &req[off];
+  char msg[PATH_MAX + 64];
+  struct stat st;
+  int err = stat(path, &st) == -1 ? errno : 0;
+  if (err || !S_ISREG(st.st_mode)){
+    len = snprintf(msg, sizeof(msg), "ctext: %s: %s\r\n", path,
+                   err ? strerror(err) : "not a regular file");
+    serverWrite(cfd, msg, len);
+    return;
+  }
+
+  struct serverHolder* h = NULL;
+  for (int i = 0; i < SERVER_FILES && h == NULL; i++)
+    if (held[i].path && !strcmp(held[i].path, path)) h = &held[i];
+  if (h && (h->size != st.st_size || h->mtime.tv_sec != st.st_mtim.tv_sec ||
+            h->mtime.tv_nsec != st.st_mtim.tv_nsec))
+    serverRelease(h);
+  if (h == NULL){
+    h = &held[0];
+    for (int i = 1; i < SERVER_FILES && h->path; i++)
+      if (held[i].path == NULL || held[i].used < h->used) h = &held[i];
+    serverRelease(h);
+  }
+
+  len = snprintf(msg, sizeof(msg), "%d %d", rows, cols);
+  for (int tries = 0; tries < 2; tries++){
+    if (h->path == NULL && serverSpawn(held, h, path, &st, lfd, cfd) == -1) break;
+    if (serverSendFd(h->fd, cfd, msg, len) == 0){
+      h->used = tick;
+      return;
+    }
+    serverRelease(h);
+  }
+  len = snprintf(msg, sizeof(msg), "ctext: %s: no session: %s\r\n", path, strerror(errno));
+  serverWrite(cfd, msg, len);
+}
+
+int editorServe(void){
+  struct sockaddr_un addr;
+  if (serverSocketPath(&addr) == -1) return 1;
+  int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (lfd == -1){
+    perror("socket");
+    return 1;
+  }
+  if (connect(lfd, (struct sockaddr*)&addr, sizeof(addr)) == 0){
+    fprintf(stderr, "ctext: a server is already running on %s\n", addr.sun_path);
+    return 1;
+  }
+  close(lfd);
+  lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(addr.sun_path);
+  mode_t mask = umask(077);
+  int ok = lfd != -1 && bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+           listen(lfd, 16) == 0;
+  umask(mask);
+  if (!ok){
+    perror(addr.sun_path);
+    return 1;
+  }
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  /* no SA_RESTART, accept returns to check for the signal */
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handleSigHangup;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGHUP, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  fprintf(stderr, "ctext: serving on %s\n", addr.sun_path);
+
+  struct serverHolder held[SERVER_FILES];
+  memset(held, 0, sizeof(held));
+  for (long long tick = 1; !hangup_pending; tick++){
+    int cfd = accept(lfd, NULL, NULL);
+    if (cfd == -1){
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept");
+      unlink(addr.sun_path);
+      return 1;
+    }
+    if (!serverPeerIsUs(cfd)){
+      close(cfd);
+      continue;
+    }
+    serverAccept(held, lfd, cfd, tick);
+    close(cfd);
+  }
+  unlink(addr.sun_path);
+  return 0;
+}
+
+int editorAttach(const char* filename){
+  char* path = realpath(filename, NULL);
+  if (path == NULL){
+    perror(filename);
+    return 1;
+  }
+  struct sockaddr_un addr;
+  if (serverSocketPath(&addr) == -1) return 1;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1){
+    fprintf(stderr, "ctext: no server on %s, start one with ctext --server\n", addr.sun_path);
+    return 1;
+  }
+  if (!serverPeerIsUs(fd)){
+    fprintf(stderr, "ctext: the server on %s is not running as you\n", addr.sun_path);
+    return 1;
+  }
+  struct winsize ws;
+  int rows = 24, cols = 80;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col){
+    rows = ws.ws_row;
+    cols = ws.ws_col;
+  }
+  char msg[PATH_MAX + 32];
+  int len = snprintf(msg, sizeof(msg), "%d %d %s\n", rows, cols, path);
+  free(path);
+  if (serverWrite(fd, msg, len) == -1){
+    perror("write");
+    return 1;
+  }
+  enableRawMode();
+  editorInstallSignals();
+  signal(SIGPIPE, SIG_IGN);
+
+  struct pollfd pfd[2] = { { STDIN_FILENO, POLLIN, 0 }, { fd, POLLIN, 0 } };
+  char buf[1 << 16];
+  while (!hangup_pending){
+    if (winch_pending){
+      winch_pending = 0;
+      if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col){
+        len = snprintf(msg, sizeof(msg), "\x1b[8;%d;%dt", ws.ws_row, ws.ws_col);
+        if (serverWrite(fd, msg, len) == -1) break;
+      }
+    }
+    if (poll(pfd, 2, -1) == -1){
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (pfd[1].revents){
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n <= 0 || serverWrite(STDOUT_FILENO, buf, n) == -1) break;
+    }
+    if (pfd[0].revents){
+      ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+      if (n <= 0 || serverWrite(fd, buf, n) == -1) break;
+    }
+  }
+  return 0;
+}
+
 /* Init */
 
 void initEditor(void)
 {
   E.numrows = 0;
   E.rows = NULL;
+  E.softwrap = 0;
+  E.wraptree = NULL;
+  E.wrapsize = 0;
+  E.wrapcols = 0;
+  E.wrapfrom = INT_MAX;
   E.cx = 0;
   E.rx = 0;
   E.cy = 0;
@@ -1082,21 +5821,71 @@ void initEditor(void)
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
   E.dirty = 0;
+  E.save.pid = 0;
+  memset(&E.index, 0, sizeof(E.index));
+  memset(&E.frame, 0, sizeof(E.frame));
+  memset(&E.gz, 0, sizeof(E.gz));
+  memset(&E.hex, 0, sizeof(E.hex));
+  memset(&E.cache, 0, sizeof(E.cache));
+  memset(&E.clip, 0, sizeof(E.clip));
+  memset(&E.track, 0, sizeof(E.track));
+  E.hlfrom = -1;
+  E.gutter = 0;
+  E.mark = -1;
+  E.journal.enabled = 0;
+  E.journal.replaying = 0;
+  E.journal.fd = -1;
+  E.journal.path = NULL;
+  E.journal.buf.b = NULL;
+  E.journal.buf.len = 0;
+  E.journal.buf.tag = MEM_JOURNAL;
+  E.journal.compactpid = 0;
   E.syntax = NULL;
+  E.classes = NULL;
   if (getWindowSize(&E.screenrows, &E.screencols) == -1)
     die("getWindowSize");
   E.screenrows -= 2;
 }
 
+void editorInstallSignals(void)
+{
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handleSigWinch;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGWINCH, &sa, NULL);
+  sa.sa_handler = handleSigHangup;
+  sigaction(SIGHUP, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+}
+
 int main(int argc, char *argv[])
 {
+  if (argc == 4 && !strcmp(argv[1], "-e"))
+    return editorBatch(argv[2], argv[3]);
+  if (argc == 2 && !strcmp(argv[1], "--server"))
+    return editorServe();
+  if (argc == 3 && !strcmp(argv[1], "-a"))
+    return editorAttach(argv[2]);
+  int argi = 1;
+  int hex = 0;
+  int cache = 0;
+  for (; argi < argc; argi++){
+    if (!strcmp(argv[argi], "-m")) atexit(editorDumpMemory);
+    else if (!strcmp(argv[argi], "-x")) hex = 1;
+    else if (!strcmp(argv[argi], "-c")) cache = 1;
+    else break;
+  }
   enableRawMode();
   initEditor();
-  if (argc >= 2)
+  E.cache.enabled = cache;
+  editorInstallSignals();
+  editorSetStatusMessage(HELP_MESSAGE);
+  if (argi < argc)
   {
-    editorOpen(argv[1]);
+    if (hex) editorOpenHex(argv[argi]);
+    else editorOpen(argv[argi]);
   }
-  editorSetStatusMessage("HELP: Ctrl-X = quit | Ctrl-S = save | Ctrl-F = find");
   while (true)
   {
     editorRefreshScreen();
@@ -0,0 +1,60 @@
+/* Inflates a gzip member made of stored blocks whose last block ends
+   exactly on a GZ_SLICE boundary, which must not fail its checksum. */
+
+#define main ctext_main
+#include "../ctext.c"
+#undef main
+
+int main(void)
+{
+  char path[] = "/tmp/ctext-gzXXXXXX.gz";
+  int fd = mkstemps(path, 3);
+  if (fd == -1)
+  {
+    perror("mkstemps");
+    return 1;
+  }
+  static unsigned char data[GZ_SLICE];
+  for (int i = 0; i < GZ_SLICE; i++)
+    data[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+
+  struct abuff ab = ABUFF_INIT;
+  abAppend(&ab, "\x1f\x8b\x08\0\0\0\0\0\0\xff", 10);
+  for (int off = 0; off < GZ_SLICE; off += 65535)
+  {
+    unsigned len = GZ_SLICE - off < 65535 ? GZ_SLICE - off : 65535;
+    unsigned char hdr[5] = { off + len == GZ_SLICE, len & 0xff, len >> 8,
+                             ~len & 0xff, (~len >> 8) & 0xff };
+    abAppend(&ab, (char*)hdr, 5);
+    abAppend(&ab, (char*)&data[off], len);
+  }
+  uint32_t crc = gzCrc(0, data, GZ_SLICE), size = GZ_SLICE;
+  unsigned char trailer[8];
+  for (int i = 0; i < 4; i++)
+  {
+    trailer[i] = crc >> (8 * i);
+    trailer[4 + i] = size >> (8 * i);
+  }
+  abAppend(&ab, (char*)trailer, 8);
+  if (write(fd, ab.b, ab.len) != ab.len)
+  {
+    perror("write");
+    return 1;
+  }
+  close(fd);
+
+  E.screenrows = 24;
+  E.screencols = 80;
+  E.journal.fd = -1;
+  E.mark = -1;
+  E.hlfrom = -1;
+  editorOpenGzip(path);
+  editorGzipFinish();
+  unlink(path);
+  if (strncmp(E.statusmsg, "Inflated", 8) != 0 || E.numrows != GZ_SLICE / 64)
+  {
+    fprintf(stderr, "gzip_boundary: %s (%d lines)\n", E.statusmsg, E.numrows);
+    return 1;
+  }
+  return 0;
+}
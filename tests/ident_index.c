@@ -0,0 +1,125 @@
+/* Random edits must leave the identifier index equal to one built from
+   scratch: the same identifiers, totals and sorted posting lists. */
+
+#define main ctext_main
+#include "../ctext.c"
+#undef main
+
+static void setup(void)
+{
+  E.screenrows = 24;
+  E.screencols = 80;
+  E.journal.fd = -1;
+  E.mark = -1;
+  E.hlfrom = -1;
+  E.wrapfrom = INT_MAX;
+}
+
+/* occurrences of id in row, split the way editorIndexRow splits words */
+static int count(ident* id, erow* row)
+{
+  int n = 0;
+  for (int i = 0; i < row->size;)
+  {
+    if (!isIdentChar(row->chars[i]))
+    {
+      i++;
+      continue;
+    }
+    int start = i;
+    while (i < row->size && isIdentChar(row->chars[i]))
+      i++;
+    if (!isdigit((unsigned char)row->chars[start]) && i - start == id->len &&
+        !memcmp(&row->chars[start], id->name, id->len))
+      n++;
+  }
+  return n;
+}
+
+static int check(void)
+{
+  int idents = 0;
+  for (int c = 0; c < E.index.cap; c++)
+  {
+    for (ident* id = E.index.table[c]; id; id = id->next)
+    {
+      int total = 0, nrows = 0;
+      idents++;
+      for (int r = 0; r < E.numrows; r++)
+      {
+        int n = count(id, &E.rows[r]);
+        if (n == 0)
+          continue;
+        if (nrows >= id->nrows || E.index.uidrow[id->rows[nrows]] != r)
+          return -1;
+        total += n;
+        nrows++;
+      }
+      if (total != id->total || nrows != id->nrows || (nrows == 0 && id->pins == 0))
+        return -1;
+    }
+  }
+  /* every identifier in the text is indexed */
+  for (int r = 0; r < E.numrows; r++)
+  {
+    for (int k = 0; k < E.rows[r].nidents; k++)
+      if (identLookup(E.rows[r].idents[k].id->name, E.rows[r].idents[k].id->len, 0) == NULL)
+        return -1;
+  }
+  return idents == E.index.count ? 0 : -1;
+}
+
+int main(void)
+{
+  const char* words[] = { "foo", "bar", "foo_bar", "q", "x1", "1x", " ", "(", "\xc3\xa9t\xc3\xa9" };
+  const char inserts[] = "abq_ (1";
+  int nwords = sizeof(words) / sizeof(words[0]);
+  setup();
+  srand(1);
+  for (int i = 0; i < 50; i++)
+  {
+    char buf[256];
+    int len = 0;
+    for (int k = rand() % 8; k > 0; k--)
+      len += sprintf(&buf[len], "%s ", words[rand() % nwords]);
+    editorInsertRow(E.numrows, buf, len);
+  }
+
+  for (int step = 0; step < 2000; step++)
+  {
+    int r = rand() % E.numrows;
+    erow* row = &E.rows[r];
+    switch (rand() % 8)
+    {
+    case 0: case 1: case 2:
+      editorRowInsertChar(row, rand() % (row->size + 1), inserts[rand() % 7]);
+      break;
+    case 3: case 4:
+      if (row->size)
+        editorRowDelChars(row, rand() % row->size, 1);
+      break;
+    case 5:
+      if (row->size < 60)
+        editorRowAppendString(row, "foo bar", 7);
+      break;
+    case 6:
+      if (E.numrows > 20)
+        editorDelRow(r);
+      break;
+    case 7:
+      if (E.numrows > 60)
+        break;
+      editorYankRows(r, E.numrows - r < 3 ? E.numrows - r : 3);
+      editorPasteRows(rand() % (E.numrows + 1));
+      break;
+    }
+    if (E.numrows < 20)
+      editorInsertRow(rand() % E.numrows, "foo q", 5);
+    if (check() == -1)
+    {
+      fprintf(stderr, "ident_index: index differs from the text after step %d\n", step);
+      return 1;
+    }
+  }
+  return 0;
+}
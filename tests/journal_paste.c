@@ -0,0 +1,67 @@
+/* A paste made while a background save runs must survive a crash, even
+   though the yank it copies is dropped from the journal once the save
+   completes. */
+
+#define main ctext_main
+#include "../ctext.c"
+#undef main
+
+static void setup(void)
+{
+  E.screenrows = 24;
+  E.screencols = 80;
+  E.journal.fd = -1;
+  E.mark = -1;
+  E.hlfrom = -1;
+  E.wrapfrom = INT_MAX;
+}
+
+int main(void)
+{
+  char path[] = "/tmp/ctext-jpXXXXXX";
+  int fd = mkstemp(path);
+  const char* text = "one\ntwo\nthree\nfour\nfive\n";
+  if (fd == -1 || write(fd, text, strlen(text)) != (ssize_t)strlen(text))
+  {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+
+  /* the session yanks, saves, pastes during the save and then dies with
+     its journal left behind */
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    setup();
+    editorOpen(path);
+    editorYankRows(1, 1);
+    editorRowInsertChar(&E.rows[0], 0, 'X');
+    editorSave();
+    editorPasteRows(3);
+    int redraw;
+    while (editorSaveJob(&redraw) != JOB_DONE)
+      usleep(1000);
+    editorJournalFlush();
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+
+  setup();
+  editorOpen(path);
+  const char* want[] = { "Xone", "two", "three", "two", "four", "five" };
+  int ok = E.numrows == 6;
+  for (int i = 0; ok && i < 6; i++)
+    ok = !strcmp(E.rows[i].chars, want[i]);
+  if (!ok)
+  {
+    fprintf(stderr, "journal_paste: recovered %d rows:", E.numrows);
+    for (int i = 0; i < E.numrows; i++)
+      fprintf(stderr, " %s", E.rows[i].chars);
+    fprintf(stderr, "\n");
+  }
+  editorJournalDiscard();
+  unlink(path);
+  return !ok;
+}
@@ -0,0 +1,129 @@
+/* A session that saves, keeps editing, compacts its journal and then dies
+   must be recovered to exactly the text it had: multi-byte deletes, row
+   edits, yanks and pastes on both sides of the save and of the compaction. */
+
+#define main ctext_main
+#include "../ctext.c"
+#undef main
+
+static void setup(void)
+{
+  E.screenrows = 24;
+  E.screencols = 80;
+  E.journal.fd = -1;
+  E.mark = -1;
+  E.hlfrom = -1;
+  E.wrapfrom = INT_MAX;
+}
+
+static void edits(void)
+{
+  editorYankRows(0, 2);
+  editorPasteRows(E.numrows);
+  editorInsertRow(1, "new row", 7);
+  editorRowAppendString(&E.rows[2], " tail", 5);
+  editorDelRow(3);
+  E.cy = 1;
+  E.cx = 3;
+  editorInsertNewLine();
+  E.cy = 0;
+  E.cx = E.rows[0].size;
+  editorDelChar();
+}
+
+static void finish(int fd)
+{
+  for (int i = 0; i < E.numrows; i++)
+  {
+    if (write(fd, E.rows[i].chars, E.rows[i].size) != E.rows[i].size || write(fd, "\n", 1) != 1)
+      _exit(1);
+  }
+  close(fd);
+}
+
+int main(void)
+{
+  char path[] = "/tmp/ctext-jrXXXXXX";
+  int fd = mkstemp(path);
+  const char* text = "caf\xc3\xa9\none\ntwo\nthree\n";
+  if (fd == -1 || write(fd, text, strlen(text)) != (ssize_t)strlen(text))
+  {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+
+  int pipefd[2];
+  if (pipe(pipefd) == -1)
+  {
+    perror("pipe");
+    return 1;
+  }
+
+  /* the session sends the text it had when it died */
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    int redraw;
+    close(pipefd[0]);
+    setup();
+    editorOpen(path);
+    E.cy = 0;
+    E.cx = E.rows[0].size;
+    editorDelChar();
+    edits();
+    editorSave();
+    edits();
+    while (editorSaveJob(&redraw) != JOB_DONE)
+      usleep(1000);
+    edits();
+
+    /* grow the journal past the compaction threshold */
+    for (int i = 0; i < JOURNAL_COMPACT / 14; i++)
+    {
+      editorRowInsertChar(&E.rows[1], 0, 'x');
+      editorRowDelChars(&E.rows[1], 0, 1);
+    }
+    editorJournalFlush();
+    editorJournalJob(&redraw);
+    edits();
+    while (editorJournalJob(&redraw) != JOB_DONE)
+      usleep(1000);
+    if (lseek(E.journal.fd, 0, SEEK_END) >= JOURNAL_COMPACT)
+      _exit(1);
+    edits();
+    editorJournalFlush();
+    finish(pipefd[1]);
+    _exit(0);
+  }
+  close(pipefd[1]);
+  struct abuff want = ABUFF_INIT;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(pipefd[0], buf, sizeof(buf))) > 0)
+    abAppend(&want, buf, n);
+  close(pipefd[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    fprintf(stderr, "journal_recovery: session failed\n");
+    unlink(path);
+    return 1;
+  }
+
+  setup();
+  editorOpen(path);
+  struct abuff got = ABUFF_INIT;
+  for (int i = 0; i < E.numrows; i++)
+  {
+    abAppend(&got, E.rows[i].chars, E.rows[i].size);
+    abAppend(&got, "\n", 1);
+  }
+  int ok = got.len == want.len && !memcmp(got.b, want.b, got.len);
+  if (!ok)
+    fprintf(stderr, "journal_recovery: recovered\n%.*s\nwanted\n%.*s\n", got.len, got.b, want.len, want.b);
+  editorJournalDiscard();
+  unlink(path);
+  return !ok;
+}
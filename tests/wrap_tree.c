@@ -0,0 +1,100 @@
+/* After any mix of row inserts, deletes and edits, syncing the soft wrap
+   tree must give the same tree, and the same visual line for every row, as
+   rebuilding it from scratch. */
+
+#define main ctext_main
+#include "../ctext.c"
+#undef main
+
+static void setup(void)
+{
+  E.screenrows = 24;
+  E.screencols = 20;
+  E.journal.fd = -1;
+  E.mark = -1;
+  E.hlfrom = -1;
+  E.wrapfrom = INT_MAX;
+}
+
+/* a row of n characters, some of them tabs and double-width */
+static int fill(char* buf, int n)
+{
+  int len = 0;
+  for (int i = 0; i < n; i++)
+  {
+    switch (rand() % 8)
+    {
+    case 0:
+      buf[len++] = '\t';
+      break;
+    case 1:
+      memcpy(&buf[len], "\xe4\xb8\xad", 3);
+      len += 3;
+      break;
+    default:
+      buf[len++] = 'x';
+    }
+  }
+  return len;
+}
+
+int main(void)
+{
+  char buf[300];
+  setup();
+  srand(2);
+  for (int i = 0; i < 300; i++)
+    editorInsertRow(E.numrows, buf, fill(buf, rand() % 70));
+  E.softwrap = 1;
+  editorWrapRebuild();
+
+  int* want = NULL;
+  for (int step = 0; step < 5000; step++)
+  {
+    int r = rand() % E.numrows;
+    switch (rand() % 6)
+    {
+    case 0:
+      editorInsertRow(r, buf, fill(buf, rand() % 70));
+      break;
+    case 1:
+      editorInsertRow(E.numrows, buf, fill(buf, rand() % 70));
+      break;
+    case 2:
+      if (E.numrows > 50)
+        editorDelRow(r);
+      break;
+    case 3:
+      editorRowInsertChar(&E.rows[r], 0, 'z');
+      break;
+    case 4:
+      if (E.rows[r].size)
+        editorRowDelChars(&E.rows[r], 0, 1);
+      break;
+    case 5:
+      if (E.numrows > 50)
+        editorDelRow(E.numrows - 1);
+      break;
+    }
+    /* let several edits pile up before a sync */
+    if (rand() % 3 == 0)
+      continue;
+    editorWrapSync();
+    int n = E.numrows;
+    want = realloc(want, sizeof(int) * (n + 1));
+    for (int i = 0; i <= n; i++)
+      want[i] = editorWrapPrefix(i);
+    editorWrapRebuild();
+    for (int i = 0; i <= n; i++)
+    {
+      if (E.wrapsize != n || editorWrapPrefix(i) != want[i])
+      {
+        fprintf(stderr, "wrap_tree: synced tree puts row %d at line %d, rebuilt at %d, after step %d\n",
+                i, want[i], editorWrapPrefix(i), step);
+        return 1;
+      }
+    }
+  }
+  free(want);
+  return 0;
+}